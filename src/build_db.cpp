@@ -1,4 +1,3 @@
-#include <rocksdb/filter_policy.h>
 #include <rocksdb/options.h>
 #include <spdlog/spdlog.h>
 #include <unistd.h>
@@ -13,7 +12,6 @@
 #include "kaplsm/kap_options.hpp"
 #include "rocksdb/db.h"
 #include "rocksdb/slice.h"
-#include "rocksdb/table.h"
 #include "rocksdb/write_batch.h"
 #include "spdlog/common.h"
 #include "utils/utils.hpp"
@@ -31,6 +29,11 @@ typedef struct environment {
 
   std::string key_file;
   bool use_key_file = false;
+  std::string partition_file;
+  // Extra column families as name=path of a kap_options.json
+  std::vector<std::string> column_families;
+  // Storage paths as path:first_level
+  std::vector<std::string> storage_paths;
 
 } environment;
 
@@ -48,6 +51,53 @@ environment parse_args(int argc, char *argv[]) {
   app.add_option("-E,--entry_size", env.kap_opt.entry_size, "Entry size");
   app.add_option("-B,--bits_per_element", env.kap_opt.bits_per_element,
                  "Bloom filter bits");
+  app.add_flag("--intra_l0,!--no_intra_l0", env.kap_opt.intra_l0_compaction,
+               "Merge L0 runs within L0 while L1 is busy");
+  app.add_option("--intra_l0_max_size", env.kap_opt.intra_l0_max_size,
+                 "Largest run an intra-L0 compaction may write (0 for "
+                 "size_ratio buffers)");
+  app.add_flag("--grandparent_alignment", env.kap_opt.grandparent_alignment,
+               "Cut compaction outputs at level L+2 file boundaries");
+  app.add_option("--max_grandparent_overlap",
+                 env.kap_opt.max_grandparent_overlap,
+                 "Grandparent files an output may overlap before being cut");
+  app.add_flag("--hot_cold_separation", env.kap_opt.hot_cold_separation,
+               "Separate hot and cold key ranges in compaction outputs");
+  app.add_option("--hot_threshold", env.kap_opt.hot_threshold,
+                 "Relative access heat at which a key range is hot");
+  app.add_option("--hot_kapacity_bonus", env.kap_opt.hot_kapacity_bonus,
+                 "Extra hot files a level may hold beyond its kapacity");
+  app.add_flag("--read_triggered_compaction",
+               env.kap_opt.read_triggered_compaction,
+               "Merge overlapping runs under read hot key ranges");
+  app.add_option("--read_compaction_threshold",
+                 env.kap_opt.read_compaction_threshold,
+                 "Extra read probes before a read triggered merge");
+  app.add_flag("--gc_compaction", env.kap_opt.gc_compaction,
+               "Compact runs early when full of tombstones or overwrites");
+  app.add_option("--gc_garbage_ratio", env.kap_opt.gc_garbage_ratio,
+                 "Estimated garbage fraction that triggers a GC compaction");
+  app.add_flag("--idle_compaction", env.kap_opt.idle_compaction,
+               "Pay down compaction debt while foreground traffic is idle");
+  app.add_option("--idle_ops_threshold", env.kap_opt.idle_ops_threshold,
+                 "Foreground ops/sec below which the tree counts as idle");
+  app.add_flag("--blob_separation", env.kap_opt.blob_separation,
+               "Store large values in blob files");
+  app.add_option("--min_blob_size", env.kap_opt.min_blob_size,
+                 "Smallest value size stored in a blob file");
+  app.add_option("--blob_gc_age_cutoff", env.kap_opt.blob_gc_age_cutoff,
+                 "Fraction of oldest blob files compactions relocate");
+  app.add_option("--blob_gc_force_threshold",
+                 env.kap_opt.blob_gc_force_threshold,
+                 "Garbage fraction of old blob files that forces a rewrite");
+  app.add_option("--partition_file", env.partition_file,
+                 "JSON list of per key range size ratios and kapacities");
+  app.add_option("--storage_path", env.storage_paths,
+                 "Directory for the levels from first_level down, as "
+                 "path:first_level (the first path must start at level 0)");
+  app.add_option("--column_family", env.column_families,
+                 "Extra column family as name=kap_options.json, every column "
+                 "family gets all keys");
 
   // Misc commands
   app.add_option("--parallelism", env.parallelism, "Number of worker threads");
@@ -74,6 +124,26 @@ environment parse_args(int argc, char *argv[]) {
   }
   spdlog::info("Verbosity {}", app.count("-v"));
 
+  if (!env.partition_file.empty() &&
+      !env.kap_opt.ReadPartitions(env.partition_file)) {
+    exit(EXIT_FAILURE);
+  }
+  for (auto &spec : env.storage_paths) {
+    auto split = spec.rfind(':');
+    if (split == std::string::npos) {
+      spdlog::error("Invalid storage path {}, expected path:first_level",
+                    spec);
+      exit(EXIT_FAILURE);
+    }
+    env.kap_opt.AddStoragePath(spec.substr(0, split),
+                               std::stoi(spec.substr(split + 1)));
+  }
+  if (!env.kap_opt.storage_paths.empty() &&
+      env.kap_opt.storage_paths.front().first_level != 0) {
+    spdlog::error("The first storage path has to start at level 0");
+    exit(EXIT_FAILURE);
+  }
+
   return env;
 }
 
@@ -105,26 +175,26 @@ std::pair<std::string, std::string> create_kv_pair(int key, int key_size,
   return std::pair(padded_key, val);
 }
 
+// Bulk loading keeps the L0 triggers build_db always used instead of the
+// kapacity-based ones of apply_kap_options, writes only slow down at 20 files
+void apply_bulk_load_triggers(rocksdb::Options &opt,
+                              const kaplsm::KapOptions &kap_opt) {
+  opt.level0_file_num_compaction_trigger = kap_opt.size_ratio;
+  opt.level0_slowdown_writes_trigger = 20;
+  opt.level0_stop_writes_trigger =
+      rocksdb::Options().level0_stop_writes_trigger;
+}
+
 rocksdb::Options load_options(environment &env) {
   rocksdb::Options opt;
   opt.create_if_missing = true;
   opt.error_if_exists = true;
   opt.compaction_style = rocksdb::kCompactionStyleNone;
   opt.compression = rocksdb::kNoCompression;
-  opt.level0_file_num_compaction_trigger = env.kap_opt.size_ratio;
-  opt.level0_slowdown_writes_trigger = 20;
   opt.IncreaseParallelism(env.parallelism);
   opt.num_levels = 20;
-  opt.target_file_size_multiplier = env.kap_opt.size_ratio;
-  opt.target_file_size_base = env.kap_opt.buffer_size;
-  opt.write_buffer_size = env.kap_opt.buffer_size;
-
-  // Monkey filter policy
-  rocksdb::BlockBasedTableOptions table_options;
-  table_options.filter_policy.reset(rocksdb::NewMonkeyFilterPolicy(
-      env.kap_opt.bits_per_element, env.kap_opt.size_ratio, 20));
-  table_options.no_block_cache = true;
-  opt.table_factory.reset(rocksdb::NewBlockBasedTableFactory(table_options));
+  apply_kap_options(opt, env.kap_opt);
+  apply_bulk_load_triggers(opt, env.kap_opt);
 
   return opt;
 }
@@ -134,10 +204,36 @@ void build_db(environment &env) {
   rocksdb::Options rocksdb_options = load_options(env);
   auto kcompactor = new kaplsm::KapCompactor(rocksdb_options, env.kap_opt);
   rocksdb_options.listeners.emplace_back(kcompactor);
+  rocksdb_options.sst_partitioner_factory = kcompactor->GetPartitionerFactory();
   auto keys = load_keys(env);
   env.kap_opt.num_keys = keys.size();
   env.kap_opt.levels = rocksdb_options.num_levels;
 
+  // Every column family has its own compactor, all of them share the event
+  // thread and compaction pool of the default column family's compactor
+  std::vector<kaplsm::KapCompactor *> cf_compactors;
+  std::vector<rocksdb::Options> cf_options;
+  for (auto &spec : env.column_families) {
+    auto split = spec.find('=');
+    kaplsm::KapOptions cf_kap_opt;
+    if (split == std::string::npos ||
+        !cf_kap_opt.ReadConfig(spec.substr(split + 1))) {
+      spdlog::error("Invalid column family {}, expected name=path", spec);
+      exit(EXIT_FAILURE);
+    }
+    cf_kap_opt.num_keys = keys.size();
+    cf_kap_opt.levels = rocksdb_options.num_levels;
+    rocksdb::Options cf_opt(rocksdb_options);
+    apply_kap_options(cf_opt, cf_kap_opt);
+    apply_bulk_load_triggers(cf_opt, cf_kap_opt);
+    auto cf_compactor = new kaplsm::KapCompactor(
+        cf_opt, cf_kap_opt, spec.substr(0, split), kcompactor->GetScheduler());
+    cf_opt.sst_partitioner_factory = cf_compactor->GetPartitionerFactory();
+    rocksdb_options.listeners.emplace_back(cf_compactor);
+    cf_compactors.push_back(cf_compactor);
+    cf_options.push_back(cf_opt);
+  }
+
   for (auto kap_idx = 0; static_cast<size_t>(kap_idx) < env.kap_opt.kapacities.size(); kap_idx++) {
     spdlog::debug("env.kap_opt.kapacities[{}] = {}", kap_idx,
                   env.kap_opt.kapacities[kap_idx]);
@@ -148,6 +244,14 @@ void build_db(environment &env) {
   spdlog::debug("env.kap_opt.bits_per_element = {}",
                 env.kap_opt.bits_per_element);
   spdlog::debug("env.kap_opt.num_keys = {}", env.kap_opt.num_keys);
+  for (auto &partition : env.kap_opt.partitions) {
+    spdlog::debug("partition \"{}\" size_ratio = {}", partition.lower_bound,
+                  partition.size_ratio);
+  }
+  spdlog::debug("env.kap_opt.intra_l0_compaction = {}",
+                env.kap_opt.intra_l0_compaction);
+  spdlog::debug("env.kap_opt.intra_l0_max_size = {}",
+                env.kap_opt.intra_l0_max_size);
 
   // if (!env.db_path.empty()) {
   //   if (access(env.db_path.c_str(), F_OK) == 0) {
@@ -168,6 +272,20 @@ void build_db(environment &env) {
     delete db;
     exit(EXIT_FAILURE);
   }
+  std::vector<rocksdb::ColumnFamilyHandle *> cf_handles;
+  for (size_t idx = 0; idx < cf_compactors.size(); idx++) {
+    rocksdb::ColumnFamilyHandle *handle = nullptr;
+    status = db->CreateColumnFamily(
+        cf_options[idx], cf_compactors[idx]->GetColumnFamilyName(), &handle);
+    if (!status.ok()) {
+      spdlog::error("Problems creating column family {}: {}",
+                    cf_compactors[idx]->GetColumnFamilyName(),
+                    status.ToString());
+      exit(EXIT_FAILURE);
+    }
+    cf_compactors[idx]->SetColumnFamilyHandle(handle);
+    cf_handles.push_back(handle);
+  }
 
   rocksdb::WriteOptions write_opt;
   write_opt.sync = false;
@@ -181,6 +299,9 @@ void build_db(environment &env) {
   for (auto key : keys) {
     auto kv = create_kv_pair(key, env.key_size, env.kap_opt.entry_size);
     batch.Put(kv.first, kv.second);
+    for (auto handle : cf_handles) {
+      batch.Put(handle, kv.first, kv.second);
+    }
     if (batch.Count() > env.batch_size) {
       spdlog::debug("Writing batch {}", batch_num);
       db->Write(write_opt, &batch);
@@ -194,21 +315,37 @@ void build_db(environment &env) {
   }
   spdlog::debug("Flushing DB...");
   db->Flush(rocksdb::FlushOptions());
-  while (!kcompactor->CheckTreeKapacities(db)) {
-    kcompactor->ScheduleCompactionsAcrossLevels(db);
-    spdlog::debug("Waiting for {} compactions",
-                  kcompactor->GetCompactionTaskCount());
-    kcompactor->WaitForCompactions();
+  for (auto handle : cf_handles) {
+    db->Flush(rocksdb::FlushOptions(), handle);
+  }
+  cf_compactors.insert(cf_compactors.begin(), kcompactor);
+  // The tree is left within its kapacities so run_db opens it compliant
+  for (auto compactor : cf_compactors) {
+    int reconcile_tasks = compactor->ReconcileTree(db, true);
+    spdlog::debug("Reconciled column family {} with {} compactions",
+                  compactor->GetColumnFamilyName(), reconcile_tasks);
   }
 
   log_state_of_tree(db);
 
   spdlog::info("Writing kap options...");
   env.kap_opt.WriteConfig(env.db_path + "/kap_options.json");
+  for (size_t idx = 1; idx < cf_compactors.size(); idx++) {
+    auto cf_kap_opt = cf_compactors[idx]->GetKapOptions();
+    cf_kap_opt.WriteConfig(env.db_path + "/kap_options." +
+                           cf_compactors[idx]->GetColumnFamilyName() +
+                           ".json");
+  }
 
   spdlog::debug("Compactions before closing {}",
                 kcompactor->GetCompactionTaskCount());
   spdlog::info("Closing DB...");
+  for (auto compactor : cf_compactors) {
+    compactor->CancelAllCompactions(db);
+  }
+  for (auto handle : cf_handles) {
+    db->DestroyColumnFamilyHandle(handle);
+  }
   db->Close();
   delete db;
 
@@ -0,0 +1,144 @@
+#include <rocksdb/filter_policy.h>
+#include <rocksdb/options.h>
+#include <sched.h>
+#include <spdlog/spdlog.h>
+
+#include <CLI/CLI.hpp>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "kaplsm/kap_options.hpp"
+#include "kaplsm/kap_partitioner.hpp"
+#include "rocksdb/db.h"
+#include "rocksdb/table.h"
+
+// Compaction worker spawned by KapCompactionService. Runs a single compaction
+// of the DB described by <job_dir>/input, writing outputs to
+// <job_dir>/output and the serialized result to <job_dir>/result.
+typedef struct environment {
+  std::string db_path;
+  std::string job_dir;
+  std::string cpus;
+  std::string cf_name = rocksdb::kDefaultColumnFamilyName;
+} environment;
+
+environment parse_args(int argc, char *argv[]) {
+  CLI::App app{"Compaction worker"};
+  environment env;
+
+  app.add_option("db_path", env.db_path, "Database path")->required();
+  app.add_option("--job_dir", env.job_dir, "Compaction job directory")
+      ->required();
+  app.add_option("--cpus", env.cpus, "Cores to pin to (e.g. 2,3 or 4-7)");
+  app.add_option("--cf", env.cf_name, "Column family of the compaction");
+  app.add_flag("-v,--verbosity", "verbosity");
+
+  try {
+    (app).parse((argc), (argv));
+  } catch (const CLI::ParseError &e) {
+    exit((app).exit(e));
+  }
+
+  switch (app.count("-v")) {
+    case 1:
+      spdlog::set_level(spdlog::level::debug);
+      break;
+    case 2:
+      spdlog::set_level(spdlog::level::trace);
+      break;
+    default:
+      spdlog::set_level(spdlog::level::info);
+  }
+
+  return env;
+}
+
+bool pin_to_cpus(const std::string &cpus) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  std::stringstream ss(cpus);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    auto dash = range.find('-');
+    int first = std::stoi(range.substr(0, dash));
+    int last =
+        dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+    for (int cpu = first; cpu <= last; cpu++) {
+      CPU_SET(cpu, &set);
+    }
+  }
+
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+rocksdb::CompactionServiceOptionsOverride load_override_options(
+    const kaplsm::KapOptions &kap_opt) {
+  rocksdb::CompactionServiceOptionsOverride opt;
+  opt.env = rocksdb::Env::Default();
+
+  // Options that cannot be serialized with the compaction input must match
+  // the primary's
+  rocksdb::BlockBasedTableOptions table_options;
+  table_options.filter_policy.reset(rocksdb::NewMonkeyFilterPolicy(
+      kap_opt.bits_per_element, kap_opt.size_ratio, 20));
+  table_options.no_block_cache = true;
+  opt.table_factory.reset(rocksdb::NewBlockBasedTableFactory(table_options));
+
+  // Outputs still have to respect the key range partitions, grandparent
+  // boundaries and access heat are only known to the primary
+  if (kap_opt.partitions.size() > 1) {
+    auto factory = std::make_shared<kaplsm::KapPartitionerFactory>(
+        kap_opt.buffer_size, kap_opt.max_grandparent_overlap);
+    std::vector<std::string> partition_bounds;
+    for (size_t idx = 1; idx < kap_opt.partitions.size(); idx++) {
+      partition_bounds.push_back(kap_opt.partitions[idx].lower_bound);
+    }
+    factory->SetPartitionBounds(partition_bounds);
+    opt.sst_partitioner_factory = factory;
+  }
+
+  return opt;
+}
+
+int main(int argc, char *argv[]) {
+  environment env = parse_args(argc, argv);
+
+  if (!env.cpus.empty() && !pin_to_cpus(env.cpus)) {
+    spdlog::warn("Unable to pin compaction worker to cores {}", env.cpus);
+  }
+
+  std::ifstream input_file(env.job_dir + "/input", std::ios::binary);
+  if (!input_file.is_open()) {
+    spdlog::error("Unable to read compaction input in {}", env.job_dir);
+    return EXIT_FAILURE;
+  }
+  std::stringstream input;
+  input << input_file.rdbuf();
+
+  // build_db writes the options of each extra column family next to the
+  // default column family's
+  std::string kap_options_file =
+      env.cf_name == rocksdb::kDefaultColumnFamilyName
+          ? env.db_path + "/kap_options.json"
+          : env.db_path + "/kap_options." + env.cf_name + ".json";
+  kaplsm::KapOptions kap_opt(kap_options_file);
+  std::string result;
+  rocksdb::Status status = rocksdb::DB::OpenAndCompact(
+      rocksdb::OpenAndCompactOptions(), env.db_path, env.job_dir + "/output",
+      input.str(), &result, load_override_options(kap_opt));
+  if (!status.ok()) {
+    spdlog::error("Compaction failed: {}", status.ToString());
+    return EXIT_FAILURE;
+  }
+
+  std::ofstream result_file(env.job_dir + "/result", std::ios::binary);
+  if (!result_file.is_open()) {
+    spdlog::error("Unable to write compaction result in {}", env.job_dir);
+    return EXIT_FAILURE;
+  }
+  result_file << result;
+  result_file.close();
+
+  return EXIT_SUCCESS;
+}
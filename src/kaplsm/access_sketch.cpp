@@ -0,0 +1,177 @@
+#include "access_sketch.hpp"
+
+#include <algorithm>
+
+using namespace kaplsm;
+
+// Times the key range may be widened. Each widening adds a quarter of
+// headroom, so this covers a key space growing by orders of magnitude while
+// bounding the retired ranges kept for lock-free readers.
+static const size_t kMaxKeyBounds = 64;
+
+AccessSketch::AccessSketch(size_t num_buckets, uint64_t decay_interval)
+    : counters_(std::max<size_t>(num_buckets, 1)),
+      decay_interval_(std::max<uint64_t>(decay_interval, 1)) {}
+
+void AccessSketch::SetKeyBounds(const std::string& smallest,
+                                const std::string& largest) {
+  std::lock_guard<std::mutex> lock(this->bounds_mutex_);
+  const Bounds* old_bounds = this->bounds_.load(std::memory_order_acquire);
+  auto lower = std::min(smallest, largest);
+  auto upper = std::max(smallest, largest);
+  if (old_bounds != nullptr) {
+    if (lower >= old_bounds->smallest && upper <= old_bounds->largest) {
+      return;
+    }
+    if (this->all_bounds_.size() >= kMaxKeyBounds) {
+      // Keys past the bounds keep landing in the first or last bucket
+      return;
+    }
+    lower = std::min(lower, old_bounds->smallest);
+    upper = std::max(upper, old_bounds->largest);
+  }
+
+  // Keys in a tree usually share a long prefix (e.g. zero padded integers),
+  // so positions are taken from the bytes right after the common prefix
+  size_t prefix_len = 0;
+  while (prefix_len < lower.size() && prefix_len < upper.size() &&
+         lower[prefix_len] == upper[prefix_len]) {
+    prefix_len++;
+  }
+  auto bounds = std::make_unique<Bounds>();
+  bounds->prefix = lower.substr(0, prefix_len);
+  bounds->smallest = lower;
+  bounds->largest = upper;
+  bounds->lower_pos = KeyPosition(*bounds, lower);
+  bounds->upper_pos = KeyPosition(*bounds, upper);
+  if (old_bounds != nullptr) {
+    // Keys went past the old bounds, leave a quarter of the range as
+    // headroom for the next ones
+    uint64_t headroom = (bounds->upper_pos - bounds->lower_pos) / 4;
+    headroom = std::min(headroom, UINT64_MAX - bounds->upper_pos);
+    if (headroom > 0) {
+      bounds->upper_pos += headroom;
+      bounds->largest = KeyAt(*bounds, bounds->upper_pos);
+    }
+
+    // Each old bucket moves to the new bucket holding its midpoint
+    size_t num_buckets = counters_.size();
+    double old_width =
+        static_cast<double>(old_bounds->upper_pos - old_bounds->lower_pos) + 1;
+    std::vector<uint64_t> counts(num_buckets, 0);
+    for (size_t idx = 0; idx < num_buckets; idx++) {
+      auto mid = old_bounds->lower_pos +
+                 static_cast<uint64_t>((idx + 0.5) * old_width / num_buckets);
+      auto bucket = Bucket(*bounds, KeyAt(*old_bounds, mid), num_buckets);
+      counts[bucket] += counters_[idx].load(std::memory_order_relaxed);
+    }
+    for (size_t idx = 0; idx < num_buckets; idx++) {
+      counters_[idx].store(counts[idx], std::memory_order_relaxed);
+    }
+  }
+  this->bounds_.store(bounds.get(), std::memory_order_release);
+  this->all_bounds_.push_back(std::move(bounds));
+}
+
+uint64_t AccessSketch::KeyPosition(const Bounds& bounds, const Slice& key) {
+  size_t prefix_len = bounds.prefix.size();
+  Slice key_prefix(key.data(), std::min(key.size(), prefix_len));
+  int cmp = key_prefix.compare(bounds.prefix);
+  if (cmp < 0) {
+    return 0;
+  } else if (cmp > 0) {
+    return UINT64_MAX;
+  }
+
+  uint64_t pos = 0;
+  for (size_t idx = 0; idx < sizeof(uint64_t); idx++) {
+    size_t offset = prefix_len + idx;
+    pos <<= 8;
+    if (offset < key.size()) {
+      pos |= static_cast<unsigned char>(key[offset]);
+    }
+  }
+
+  return pos;
+}
+
+std::string AccessSketch::KeyAt(const Bounds& bounds, uint64_t pos) {
+  std::string key = bounds.prefix;
+  for (int shift = 56; shift >= 0; shift -= 8) {
+    key.push_back(static_cast<char>((pos >> shift) & 0xff));
+  }
+
+  return key;
+}
+
+size_t AccessSketch::Bucket(const Bounds& bounds, const Slice& key,
+                            size_t num_buckets) {
+  auto pos =
+      std::clamp(KeyPosition(bounds, key), bounds.lower_pos, bounds.upper_pos);
+  double width = static_cast<double>(bounds.upper_pos - bounds.lower_pos) + 1;
+  auto bucket = static_cast<size_t>(
+      (static_cast<double>(pos - bounds.lower_pos) / width) * num_buckets);
+
+  return std::min(bucket, num_buckets - 1);
+}
+
+size_t AccessSketch::Bucket(const Slice& key) const {
+  return Bucket(*this->bounds_.load(std::memory_order_acquire), key,
+                counters_.size());
+}
+
+void AccessSketch::Record(const Slice& key) {
+  if (!this->HasKeyBounds()) {
+    return;
+  }
+  counters_[this->Bucket(key)].fetch_add(1, std::memory_order_relaxed);
+  if ((records_.fetch_add(1, std::memory_order_relaxed) + 1) %
+          decay_interval_ ==
+      0) {
+    // Racing records may be lost while halving, the sketch is approximate
+    for (auto& counter : counters_) {
+      counter.store(counter.load(std::memory_order_relaxed) / 2,
+                    std::memory_order_relaxed);
+    }
+  }
+}
+
+double AccessSketch::MeanCount() const {
+  uint64_t total = 0;
+  for (auto& counter : counters_) {
+    total += counter.load(std::memory_order_relaxed);
+  }
+
+  return static_cast<double>(total) / counters_.size();
+}
+
+double AccessSketch::RelativeHeat(const Slice& smallest,
+                                  const Slice& largest) const {
+  double mean = this->MeanCount();
+  if (!this->HasKeyBounds() || mean == 0) {
+    return 0;
+  }
+
+  size_t first = this->Bucket(smallest);
+  size_t last = this->Bucket(largest);
+  uint64_t total = 0;
+  for (size_t idx = first; idx <= last; idx++) {
+    total += counters_[idx].load(std::memory_order_relaxed);
+  }
+
+  return (static_cast<double>(total) / (last - first + 1)) / mean;
+}
+
+std::vector<bool> AccessSketch::HotBuckets(double threshold) const {
+  std::vector<bool> hot(counters_.size(), false);
+  double mean = this->MeanCount();
+  if (!this->HasKeyBounds() || mean == 0) {
+    return hot;
+  }
+  for (size_t idx = 0; idx < counters_.size(); idx++) {
+    hot[idx] = counters_[idx].load(std::memory_order_relaxed) >=
+               threshold * mean;
+  }
+
+  return hot;
+}
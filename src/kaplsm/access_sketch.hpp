@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "rocksdb/slice.h"
+
+using ROCKSDB_NAMESPACE::Slice;
+
+namespace kaplsm {
+
+// Access frequency sketch over the key space. Keys are mapped to equal width,
+// order preserving buckets between the smallest and largest key of the tree,
+// and every read or write bumps the counter of its bucket. Counters are halved
+// every decay_interval records so the sketch follows shifting hot spots.
+class AccessSketch {
+ public:
+  AccessSketch(size_t num_buckets, uint64_t decay_interval);
+
+  // Sets the key range covered by the sketch. Later calls only widen it: the
+  // counters are then carried over to the buckets of the wider range, which
+  // gets some headroom past the largest key so a growing key space does not
+  // remap on every call. The range is widened a bounded number of times,
+  // after which keys past it count toward the edge buckets. Records made
+  // before the bounds are known are dropped.
+  void SetKeyBounds(const std::string& smallest, const std::string& largest);
+
+  bool HasKeyBounds() const {
+    return bounds_.load(std::memory_order_acquire) != nullptr;
+  }
+
+  void Record(const Slice& key);
+
+  size_t Bucket(const Slice& key) const;
+
+  size_t NumBuckets() const { return counters_.size(); }
+
+  // Access density of the buckets spanned by [smallest, largest] relative to
+  // the mean density over the whole key space, 1.0 means average heat
+  double RelativeHeat(const Slice& smallest, const Slice& largest) const;
+
+  // Marks every bucket whose count is at least threshold times the mean
+  std::vector<bool> HotBuckets(double threshold) const;
+
+ private:
+  // Keys are positioned by the 8 bytes after the prefix shared by the bounds
+  struct Bounds {
+    std::string prefix;
+    std::string smallest;
+    std::string largest;
+    uint64_t lower_pos = 0;
+    uint64_t upper_pos = 0;
+  };
+
+  static uint64_t KeyPosition(const Bounds& bounds, const Slice& key);
+  // Smallest key at the given position, the inverse of KeyPosition
+  static std::string KeyAt(const Bounds& bounds, uint64_t pos);
+  static size_t Bucket(const Bounds& bounds, const Slice& key,
+                       size_t num_buckets);
+  double MeanCount() const;
+
+  std::vector<std::atomic<uint64_t>> counters_;
+  uint64_t decay_interval_;
+  std::atomic<uint64_t> records_{0};
+
+  // Readers load the current bounds without locking, replaced bounds are
+  // kept alive until the sketch goes away (at most kMaxKeyBounds of them)
+  std::mutex bounds_mutex_;
+  std::atomic<const Bounds*> bounds_{nullptr};
+  std::vector<std::unique_ptr<const Bounds>> all_bounds_;
+};
+
+}  // namespace kaplsm
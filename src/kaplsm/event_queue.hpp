@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+#include <vector>
+
+namespace kaplsm {
+
+// Lock-free multi producer, single consumer queue. Producers push onto an
+// atomic list head with a single CAS loop, the consumer detaches the whole
+// list at once and reverses it, so events come out in the order they were
+// pushed. Since nodes are only ever removed all together there is no ABA
+// problem to guard against.
+template <typename T>
+class EventQueue {
+ public:
+  EventQueue() = default;
+  EventQueue(const EventQueue&) = delete;
+  EventQueue& operator=(const EventQueue&) = delete;
+
+  ~EventQueue() {
+    Node* node = head_.exchange(nullptr);
+    while (node != nullptr) {
+      Node* next = node->next;
+      delete node;
+      node = next;
+    }
+  }
+
+  void Push(T value) {
+    Node* node = new Node{std::move(value), head_.load()};
+    while (!head_.compare_exchange_weak(node->next, node,
+                                        std::memory_order_release,
+                                        std::memory_order_relaxed)) {
+    }
+  }
+
+  // Removes and returns every queued event, oldest first
+  std::vector<T> PopAll() {
+    Node* node = head_.exchange(nullptr, std::memory_order_acquire);
+    std::vector<T> values;
+    while (node != nullptr) {
+      values.push_back(std::move(node->value));
+      Node* next = node->next;
+      delete node;
+      node = next;
+    }
+    return std::vector<T>(std::make_move_iterator(values.rbegin()),
+                          std::make_move_iterator(values.rend()));
+  }
+
+  bool Empty() const { return head_.load() == nullptr; }
+
+ private:
+  struct Node {
+    T value;
+    Node* next;
+  };
+
+  std::atomic<Node*> head_{nullptr};
+};
+
+}  // namespace kaplsm
@@ -0,0 +1,203 @@
+#include "kap_compaction_service.hpp"
+
+#include <signal.h>
+#include <spawn.h>
+#include <spdlog/spdlog.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+extern char** environ;
+
+using ROCKSDB_NAMESPACE::CompactionServiceJobStatus;
+
+using namespace kaplsm;
+
+namespace {
+thread_local bool offload_current_thread = false;
+thread_local std::string offload_cf_name;
+thread_local std::string offload_output_dir;
+}  // namespace
+
+KapCompactionService::KapCompactionService(std::string worker_path,
+                                           std::string staging_dir,
+                                           std::string worker_cpus)
+    : worker_path_(std::move(worker_path)),
+      staging_dir_(std::move(staging_dir)),
+      worker_cpus_(std::move(worker_cpus)) {}
+
+KapCompactionService::~KapCompactionService() {
+  this->CancelAwaitingJobs();
+  for (auto& [job_id, job] : this->jobs_) {
+    waitpid(job.pid, nullptr, 0);
+  }
+  // The staging directory is the user's, only the job directories created in
+  // it are removed
+  std::error_code ec;
+  for (auto& [job_id, job] : this->jobs_) {
+    std::filesystem::remove_all(job.job_dir, ec);
+  }
+  for (auto& [job_id, job_dir] : this->installing_) {
+    std::filesystem::remove_all(job_dir, ec);
+  }
+}
+
+void KapCompactionService::SetOffloadCurrentThread(
+    bool offload, const std::string& cf_name, const std::string& output_dir) {
+  offload_current_thread = offload;
+  offload_cf_name = cf_name;
+  offload_output_dir = output_dir;
+}
+
+std::string KapCompactionService::StagingDirFor(const std::string& output_dir) {
+  std::error_code ec;
+  std::filesystem::create_directories(this->staging_dir_, ec);
+  struct stat staging_stat, output_stat;
+  if (output_dir.empty() ||
+      stat(this->staging_dir_.c_str(), &staging_stat) != 0 ||
+      stat(output_dir.c_str(), &output_stat) != 0 ||
+      staging_stat.st_dev == output_stat.st_dev) {
+    return this->staging_dir_;
+  }
+
+  return (std::filesystem::path(output_dir) / "staging").string();
+}
+
+CompactionServiceScheduleResponse KapCompactionService::Schedule(
+    const CompactionServiceJobInfo& info,
+    const std::string& compaction_service_input) {
+  if (!offload_current_thread) {
+    return CompactionServiceScheduleResponse(
+        CompactionServiceJobStatus::kUseLocal);
+  }
+
+  std::string job_id =
+      std::to_string(info.job_id) + "_" + std::to_string(this->next_job_++);
+  std::filesystem::path job_dir =
+      std::filesystem::path(this->StagingDirFor(offload_output_dir)) / job_id;
+  std::error_code ec;
+  std::filesystem::create_directories(job_dir / "output", ec);
+  std::ofstream input(job_dir / "input", std::ios::binary);
+  if (ec || !input.is_open()) {
+    spdlog::warn("Unable to stage compaction job {}, running locally", job_id);
+    return CompactionServiceScheduleResponse(
+        CompactionServiceJobStatus::kUseLocal);
+  }
+  input << compaction_service_input;
+  input.close();
+
+  std::vector<std::string> args = {this->worker_path_, info.db_name,
+                                   "--job_dir", job_dir.string()};
+  if (!offload_cf_name.empty()) {
+    args.push_back("--cf");
+    args.push_back(offload_cf_name);
+  }
+  if (!this->worker_cpus_.empty()) {
+    args.push_back("--cpus");
+    args.push_back(this->worker_cpus_);
+  }
+  std::vector<char*> argv;
+  for (auto& arg : args) {
+    argv.push_back(arg.data());
+  }
+  argv.push_back(nullptr);
+
+  pid_t pid;
+  int rc = posix_spawn(&pid, this->worker_path_.c_str(), nullptr, nullptr,
+                       argv.data(), environ);
+  if (rc != 0) {
+    spdlog::warn("Unable to spawn {} ({}), running compaction locally",
+                 this->worker_path_, rc);
+    std::filesystem::remove_all(job_dir, ec);
+    return CompactionServiceScheduleResponse(
+        CompactionServiceJobStatus::kUseLocal);
+  }
+  spdlog::trace("Compaction job {} offloaded to worker {}", job_id, pid);
+
+  {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    this->jobs_[job_id] = {pid, job_dir.string()};
+  }
+  this->remote_jobs_++;
+
+  return CompactionServiceScheduleResponse(
+      job_id, CompactionServiceJobStatus::kSuccess);
+}
+
+CompactionServiceJobStatus KapCompactionService::Wait(
+    const std::string& scheduled_job_id, std::string* result) {
+  RemoteJob job;
+  {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    auto it = this->jobs_.find(scheduled_job_id);
+    if (it == this->jobs_.end()) {
+      return CompactionServiceJobStatus::kFailure;
+    }
+    job = it->second;
+    this->jobs_.erase(it);
+  }
+
+  int wstatus = 0;
+  std::error_code ec;
+  std::filesystem::path job_dir(job.job_dir);
+  if (waitpid(job.pid, &wstatus, 0) < 0 || !WIFEXITED(wstatus) ||
+      WEXITSTATUS(wstatus) != 0) {
+    spdlog::warn("Compaction worker for job {} failed", scheduled_job_id);
+    this->remote_failures_++;
+    std::filesystem::remove_all(job_dir, ec);
+    return CompactionServiceJobStatus::kFailure;
+  }
+
+  std::ifstream result_file(job_dir / "result", std::ios::binary);
+  if (!result_file.is_open()) {
+    this->remote_failures_++;
+    std::filesystem::remove_all(job_dir, ec);
+    return CompactionServiceJobStatus::kFailure;
+  }
+  std::stringstream buffer;
+  buffer << result_file.rdbuf();
+  *result = buffer.str();
+
+  // Outputs stay in place until RocksDB moves them into the DB
+  std::filesystem::remove(job_dir / "input", ec);
+  std::filesystem::remove(job_dir / "result", ec);
+  {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    this->installing_[scheduled_job_id] = job.job_dir;
+  }
+
+  return CompactionServiceJobStatus::kSuccess;
+}
+
+void KapCompactionService::OnInstallation(const std::string& scheduled_job_id,
+                                          CompactionServiceJobStatus status) {
+  std::string job_dir;
+  {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    auto it = this->installing_.find(scheduled_job_id);
+    if (it == this->installing_.end()) {
+      return;
+    }
+    job_dir = it->second;
+    this->installing_.erase(it);
+  }
+  if (status != CompactionServiceJobStatus::kSuccess) {
+    spdlog::debug("Outputs of compaction job {} were not installed",
+                  scheduled_job_id);
+  }
+  std::error_code ec;
+  std::filesystem::remove_all(job_dir, ec);
+}
+
+void KapCompactionService::CancelAwaitingJobs() {
+  std::lock_guard<std::mutex> lock(this->mutex_);
+  for (auto& [job_id, job] : this->jobs_) {
+    spdlog::debug("Terminating compaction worker {} for job {}", job.pid,
+                  job_id);
+    kill(job.pid, SIGTERM);
+  }
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "rocksdb/options.h"
+
+using ROCKSDB_NAMESPACE::CompactionService;
+using ROCKSDB_NAMESPACE::CompactionServiceJobInfo;
+using ROCKSDB_NAMESPACE::CompactionServiceJobStatus;
+using ROCKSDB_NAMESPACE::CompactionServiceScheduleResponse;
+
+namespace kaplsm {
+
+// Runs compactions in a separate local worker process (kap_worker). RocksDB
+// serializes the compaction input and hands it to Schedule, which writes it
+// into a fresh job directory under the staging directory and spawns the
+// worker. The worker opens the DB read only through DB::OpenAndCompact, writes
+// the outputs to the job's output directory and leaves the serialized result
+// next to them. Wait reaps the worker and returns the result, RocksDB then
+// renames the outputs into the DB and installs them like a local compaction,
+// after which OnInstallation removes the job directory. Renames cannot cross
+// devices, so a job whose output path lives on another device than the
+// staging directory is staged under <output path>/staging instead.
+//
+// Only compactions started by a thread that called SetOffloadCurrentThread
+// are offloaded, everything else (and any job the worker cannot be spawned
+// for) runs locally. The column family name given there is passed on to the
+// worker (--cf) so it loads that column family's KapOptions.
+class KapCompactionService : public CompactionService {
+ public:
+  // worker_cpus is passed on to the worker, which pins itself to that list
+  // of cores (e.g. "2,3" or "4-7"), empty leaves scheduling to the OS
+  KapCompactionService(std::string worker_path, std::string staging_dir,
+                       std::string worker_cpus = "");
+  ~KapCompactionService() override;
+
+  static const char* kClassName() { return "KapCompactionService"; }
+  const char* Name() const override { return kClassName(); }
+
+  CompactionServiceScheduleResponse Schedule(
+      const CompactionServiceJobInfo& info,
+      const std::string& compaction_service_input) override;
+
+  CompactionServiceJobStatus Wait(const std::string& scheduled_job_id,
+                                  std::string* result) override;
+
+  // Terminates every worker that has not been waited on yet
+  void CancelAwaitingJobs() override;
+
+  // Removes the job directory once RocksDB installed (or dropped) its outputs
+  void OnInstallation(const std::string& scheduled_job_id,
+                      CompactionServiceJobStatus status) override;
+
+  // Marks compactions run by the calling thread for offloading until unset,
+  // cf_name names the column family they compact and output_dir the directory
+  // their outputs go to (the DB directory or a storage path)
+  static void SetOffloadCurrentThread(bool offload,
+                                      const std::string& cf_name = "",
+                                      const std::string& output_dir = "");
+
+  uint64_t GetRemoteJobCount() { return remote_jobs_.load(); }
+  uint64_t GetRemoteFailureCount() { return remote_failures_.load(); }
+
+ private:
+  struct RemoteJob {
+    pid_t pid;
+    std::string job_dir;
+  };
+
+  // Directory to create job directories in for outputs going to output_dir
+  std::string StagingDirFor(const std::string& output_dir);
+
+  std::string worker_path_;
+  std::string staging_dir_;
+  std::string worker_cpus_;
+  std::mutex mutex_;
+  std::unordered_map<std::string, RemoteJob> jobs_;
+  // Job directories of jobs waited on, by job id, whose outputs RocksDB has
+  // not installed yet
+  std::unordered_map<std::string, std::string> installing_;
+  std::atomic<uint64_t> next_job_{0};
+  std::atomic<uint64_t> remote_jobs_{0};
+  std::atomic<uint64_t> remote_failures_{0};
+};
+
+}  // namespace kaplsm
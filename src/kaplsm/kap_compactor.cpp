@@ -2,9 +2,11 @@
 
 #include <spdlog/spdlog.h>
 
+#include <algorithm>
 #include <cmath>
 #include <iostream>
 
+#include "kap_compaction_service.hpp"
 #include "rocksdb/db.h"
 #include "rocksdb/listener.h"
 #include "rocksdb/metadata.h"
@@ -16,19 +18,79 @@ using ROCKSDB_NAMESPACE::FlushJobInfo;
 
 using namespace kaplsm;
 
+// Conflicts in a row after which a (level, partition) is no longer retried
+// until one of its compactions succeeds
+static const int kMaxConflictRetries = 8;
+
+void KapCompactor::OnFlushCompleted(DB* db, const FlushJobInfo& info) {
+  if (this->canceled_.load() || info.cf_name != this->cf_name_) {
+    return;
+  }
+  this->pending_events_++;
+  this->scheduler_->PushEvent({CompactorEvent::Kind::kFlush, db,
+                               info.triggered_writes_stop, this});
+}
+
+void KapCompactor::OnCompactionCompleted(DB* db,
+                                         const CompactionJobInfo& info) {
+  if (this->canceled_.load() || info.cf_name != this->cf_name_) {
+    return;
+  }
+  this->pending_events_++;
+  this->scheduler_->PushEvent(
+      {CompactorEvent::Kind::kCompaction, db, false, this});
+}
+
+void KapCompactor::HandleEvents(const std::vector<CompactorEvent>& events) {
+  DB* flush_db = nullptr;
+  DB* compaction_db = nullptr;
+  bool triggered_writes_stop = false;
+  for (auto& event : events) {
+    if (event.kind == CompactorEvent::Kind::kFlush) {
+      flush_db = event.db;
+      triggered_writes_stop |= event.triggered_writes_stop;
+    } else {
+      compaction_db = event.db;
+    }
+  }
+  // Flushes and compactions may hold keys past the bounds of the access
+  // sketch, which would all land in its first or last bucket
+  DB* db = compaction_db != nullptr ? compaction_db : flush_db;
+  if (db != nullptr && this->access_sketch_ != nullptr) {
+    this->InitAccessSketch(db);
+  }
+  // Conflicted tasks are only re-picked here, off the compaction threads, once
+  // a flush or a compaction has changed the tree they conflicted on
+  if (db != nullptr) {
+    this->RetryConflictedCompactions(db);
+  }
+  if (compaction_db != nullptr) {
+    this->PickAfterCompaction(compaction_db);
+  }
+  if (flush_db != nullptr) {
+    this->PickAfterFlush(flush_db, triggered_writes_stop);
+  }
+  spdlog::trace("Handled {} events for column family {}", events.size(),
+                this->cf_name_);
+  this->pending_events_ -= events.size();
+}
+
 // When flush happens, it determines whether to trigger compaction. If
 // triggered_writes_stop is true, it will also set the retry flag of
 // compaction-task to true.
-void KapCompactor::OnFlushCompleted(DB* db, const FlushJobInfo& info) {
+void KapCompactor::PickAfterFlush(DB* db, bool triggered_writes_stop) {
   for (auto level_idx = this->rocksdb_options_.num_levels - 1; level_idx >= 0;
        level_idx--) {
-    CompactionTask* task =
-        PickCompaction(db, info.cf_name, static_cast<size_t>(level_idx));
-    if (task != nullptr) {
-      if (info.triggered_writes_stop) {
-        task->retry_on_fail = true;
+    for (size_t partition = 0; partition < this->kap_options_.NumPartitions();
+         partition++) {
+      CompactionTask* task =
+          PickCompaction(db, "", static_cast<size_t>(level_idx), partition);
+      if (task != nullptr) {
+        if (triggered_writes_stop) {
+          task->retry_on_fail = true;
+        }
+        ScheduleCompaction(task);
       }
-      ScheduleCompaction(task);
     }
   }
 }
@@ -36,24 +98,23 @@ void KapCompactor::OnFlushCompleted(DB* db, const FlushJobInfo& info) {
 // When a compaction finishes, we will also check to make sure the state of the
 // tree is OK. This SHOULD be called until the tree returns no more viable
 // compaction jobs
-void KapCompactor::OnCompactionCompleted(DB* db,
-                                         const CompactionJobInfo& info) {
+void KapCompactor::PickAfterCompaction(DB* db) {
   for (size_t level_idx = 0;
        level_idx < static_cast<size_t>(this->rocksdb_options_.num_levels) - 1;
        level_idx++) {
-    CompactionTask* task = PickCompaction(db, info.cf_name, level_idx);
-    if (task != nullptr) {
-      ScheduleCompaction(task);
+    for (size_t partition = 0; partition < this->kap_options_.NumPartitions();
+         partition++) {
+      CompactionTask* task = PickCompaction(db, "", level_idx, partition);
+      if (task != nullptr) {
+        ScheduleCompaction(task);
+      }
     }
   }
 }
 
 std::vector<std::string> KapCompactor::CheckIfLevelNeedsCompaction(
-    rocksdb::LevelMetaData level) {
-  int level_kapacity = 1;
-  if (static_cast<size_t>(level.level) < this->kap_options_.kapacities.size()) {
-    level_kapacity = this->kap_options_.kapacities[level.level];
-  }
+    rocksdb::LevelMetaData level, size_t partition) {
+  int level_kapacity = this->kap_options_.Kapacity(partition, level.level);
   if (level.files.size() <= static_cast<size_t>(level_kapacity)) {
     return {};
   }
@@ -68,59 +129,873 @@ std::vector<std::string> KapCompactor::CheckIfLevelNeedsCompaction(
   return input_file_names;
 }
 
+rocksdb::LevelMetaData KapCompactor::PartitionLevel(
+    const rocksdb::LevelMetaData& level, size_t partition) {
+  if (level.level == 0 || this->kap_options_.partitions.empty()) {
+    return level;
+  }
+
+  // Outputs are cut at partition bounds, so a file belongs to the partition
+  // holding its smallest key
+  rocksdb::LevelMetaData partition_level;
+  partition_level.level = level.level;
+  partition_level.size = 0;
+  for (auto& file : level.files) {
+    if (this->kap_options_.PartitionOf(file.smallestkey) == partition) {
+      partition_level.files.push_back(file);
+      partition_level.size += file.size;
+    }
+  }
+
+  return partition_level;
+}
+
+std::vector<std::string> KapCompactor::PickIntraL0Files(
+    rocksdb::LevelMetaData level) {
+  // L0 files are listed newest first, stop at the first file already claimed
+  // by another compaction
+  uint64_t max_size = this->kap_options_.intra_l0_max_size;
+  if (max_size == 0) {
+    max_size = static_cast<uint64_t>(this->kap_options_.size_ratio) *
+               this->kap_options_.buffer_size;
+  }
+  std::vector<std::string> input_file_names;
+  uint64_t input_size = 0;
+  for (auto file : level.files) {
+    if (file.being_compacted || input_size + file.size > max_size) {
+      break;
+    }
+    input_size += file.size;
+    input_file_names.push_back(file.name);
+  }
+
+  return input_file_names;
+}
+
+std::vector<std::string> KapCompactor::PickReadTriggeredFiles(
+    const rocksdb::LevelMetaData& level) {
+  if (this->read_triggered_in_flight_.load() > 0) {
+    return {};
+  }
+
+  // Only the newest free files can be merged back into L0
+  auto free_files = this->PickIntraL0Files(level);
+  const rocksdb::SstFileMetaData* hottest = nullptr;
+  for (auto& file : level.files) {
+    if (file.being_compacted) {
+      break;
+    }
+    if (hottest == nullptr ||
+        file.num_reads_sampled > hottest->num_reads_sampled) {
+      hottest = &file;
+    }
+  }
+  if (hottest == nullptr || hottest->num_reads_sampled == 0) {
+    return {};
+  }
+
+  // Take the free files down to the oldest one overlapping the hottest file,
+  // the files in between are merged along to keep the run contiguous
+  size_t num_inputs = 0;
+  size_t overlapping = 0;
+  uint64_t probes = 0;
+  for (size_t idx = 0; idx < free_files.size(); idx++) {
+    auto& file = level.files[idx];
+    if (file.smallestkey <= hottest->largestkey &&
+        file.largestkey >= hottest->smallestkey) {
+      num_inputs = idx + 1;
+      overlapping++;
+      probes += file.num_reads_sampled;
+    }
+  }
+  if (overlapping < 2) {
+    return {};
+  }
+  // Every read of the range probes each overlapping run, a single merged run
+  // would save all but one of those probes
+  uint64_t extra_probes = probes - (probes / overlapping);
+  if (extra_probes < this->kap_options_.read_compaction_threshold) {
+    return {};
+  }
+  spdlog::trace("L0 read hot range costs {} extra probes over {} runs",
+                extra_probes, overlapping);
+  free_files.resize(num_inputs);
+
+  return free_files;
+}
+
+std::vector<std::string> KapCompactor::PickGarbageFiles(
+    const rocksdb::LevelMetaData& level,
+    const rocksdb::LevelMetaData* next_level) {
+  if (this->gc_in_flight_.load() > 0) {
+    return {};
+  }
+
+  double overwrite_ratio = 0;
+  uint64_t unproductive_entries = 0;
+  {
+    std::lock_guard<std::mutex> lock(this->overwrite_mutex_);
+    if (static_cast<size_t>(level.level) < this->overwrite_ratio_.size()) {
+      overwrite_ratio = this->overwrite_ratio_[level.level];
+    }
+    if (static_cast<size_t>(level.level) <
+        this->gc_unproductive_entries_.size()) {
+      unproductive_entries = this->gc_unproductive_entries_[level.level];
+    }
+  }
+
+  std::vector<std::string> input_file_names;
+  uint64_t entries = 0;
+  uint64_t deletions = 0;
+  for (auto& file : level.files) {
+    if (file.being_compacted) {
+      return {};
+    }
+    input_file_names.push_back(file.name);
+    entries += file.num_entries;
+    deletions += file.num_deletions;
+  }
+  if (entries == 0 || entries == unproductive_entries) {
+    return {};
+  }
+  // Files of a level are disjoint, so a level collected in place only drops
+  // its tombstones. Pushed down, its entries also replace older versions in
+  // L+1 at the ratio seen by past merges of L into L+1, and each tombstone
+  // shadows at least one of them.
+  double garbage = deletions;
+  uint64_t merged_entries = entries;
+  if (next_level != nullptr) {
+    for (auto& file : next_level->files) {
+      if (file.being_compacted) {
+        return {};
+      }
+      merged_entries += file.num_entries;
+    }
+    garbage = std::max(garbage, overwrite_ratio * merged_entries);
+  }
+  if (garbage / merged_entries < this->kap_options_.gc_garbage_ratio) {
+    return {};
+  }
+  spdlog::trace("Level {} estimated garbage {:.0f} of {} entries", level.level,
+                garbage, merged_entries);
+
+  return input_file_names;
+}
+
+std::vector<std::string> KapCompactor::PickBlobGarbageFiles(
+    const rocksdb::ColumnFamilyMetaData& cf_meta,
+    const rocksdb::LevelMetaData& level) {
+  if (this->blob_gc_in_flight_.load() > 0 || cf_meta.blob_files.empty()) {
+    return {};
+  }
+
+  // Same cutoff RocksDB uses to decide which blobs a compaction relocates
+  std::vector<rocksdb::BlobMetaData> blob_files(cf_meta.blob_files);
+  std::sort(blob_files.begin(), blob_files.end(), [](auto& a, auto& b) {
+    return a.blob_file_number < b.blob_file_number;
+  });
+  size_t cutoff = static_cast<size_t>(std::ceil(
+      this->kap_options_.blob_gc_age_cutoff * blob_files.size()));
+  cutoff = std::clamp<size_t>(cutoff, 1, blob_files.size());
+  uint64_t total_bytes = 0;
+  uint64_t garbage_bytes = 0;
+  for (size_t idx = 0; idx < cutoff; idx++) {
+    total_bytes += blob_files[idx].total_blob_bytes;
+    garbage_bytes += blob_files[idx].garbage_blob_bytes;
+  }
+  if (total_bytes == 0 ||
+      static_cast<double>(garbage_bytes) / total_bytes <
+          this->kap_options_.blob_gc_force_threshold) {
+    return {};
+  }
+
+  uint64_t cutoff_file_number = blob_files[cutoff - 1].blob_file_number;
+  std::vector<std::string> input_file_names;
+  for (auto& file : level.files) {
+    if (!file.being_compacted && file.oldest_blob_file_number != 0 &&
+        file.oldest_blob_file_number <= cutoff_file_number) {
+      input_file_names.push_back(file.name);
+    }
+  }
+  if (!input_file_names.empty()) {
+    spdlog::trace("Level {} rewrites {} runs for {} of {} B blob garbage",
+                  level.level, input_file_names.size(), garbage_bytes,
+                  total_bytes);
+  }
+
+  return input_file_names;
+}
+
+CompactionTask* KapCompactor::PickIdleCompaction(DB* db) {
+  ColumnFamilyMetaData cf_meta;
+  db->GetColumnFamilyMetaData(this->ColumnFamily(db), &cf_meta);
+
+  CompactionTask* task = nullptr;
+  uint64_t oldest_seqno = UINT64_MAX;
+  for (size_t level_idx = 0; level_idx + 1 < cf_meta.levels.size();
+       level_idx++) {
+    for (size_t partition = 0; partition < this->kap_options_.NumPartitions();
+         partition++) {
+      if (level_idx == 0 && partition > 0) {
+        continue;
+      }
+      auto level = this->PartitionLevel(cf_meta.levels[level_idx], partition);
+      auto next_level =
+          this->PartitionLevel(cf_meta.levels[level_idx + 1], partition);
+      int kapacity = this->kap_options_.Kapacity(partition, level.level);
+      int next_kapacity =
+          this->kap_options_.Kapacity(partition, next_level.level);
+      // Levels over kapacity are left to kapacity driven compactions
+      if (level.files.size() < 2 ||
+          level.files.size() + 1 < static_cast<size_t>(kapacity) ||
+          level.files.size() > static_cast<size_t>(kapacity) ||
+          this->LevelIsBusy(level) || this->LevelIsBusy(next_level)) {
+        continue;
+      }
+
+      // Keep the newest run in place and push everything older down
+      std::vector<rocksdb::SstFileMetaData> runs(level.files);
+      std::sort(runs.begin(), runs.end(), [](auto& a, auto& b) {
+        return a.smallest_seqno < b.smallest_seqno;
+      });
+      runs.pop_back();
+      if (runs.front().smallest_seqno >= oldest_seqno) {
+        continue;
+      }
+
+      // The next level must still be within its kapacity once the runs are
+      // merged into it, outputs being cut at the file size of the level
+      uint64_t file_size =
+          this->CompactionFileSize(cf_meta, partition, level.level);
+      uint64_t merged_bytes = next_level.size;
+      std::vector<std::string> input_file_names;
+      for (auto& run : runs) {
+        input_file_names.push_back(run.name);
+        merged_bytes += run.size;
+      }
+      auto next_files = static_cast<size_t>(
+          std::ceil(static_cast<double>(merged_bytes) / file_size));
+      if (next_files > static_cast<size_t>(next_kapacity)) {
+        continue;
+      }
+      oldest_seqno = runs.front().smallest_seqno;
+
+      rocksdb::CompactionOptions opt;
+      opt.output_file_size_limit = 1.04 * file_size;
+      delete task;
+      task = new CompactionTask(db, this, "", input_file_names,
+                                level.level + 1, level.level, opt, false);
+      task->partition = partition;
+      task->reason = TaskReason::kIdle;
+    }
+  }
+
+  return task;
+}
+
+void KapCompactor::ScheduleIdleCompaction(DB* db, double ops_per_sec) {
+  if (!this->kap_options_.idle_compaction || this->canceled_.load() ||
+      ops_per_sec >= this->kap_options_.idle_ops_threshold ||
+      this->compaction_task_count_.load() > 0) {
+    return;
+  }
+  CompactionTask* task = this->PickIdleCompaction(db);
+  if (task != nullptr) {
+    spdlog::debug("Idle at {:.0f} ops/s, compacting L{} -> L{}", ops_per_sec,
+                  task->input_level, task->output_level);
+    this->ScheduleCompaction(task);
+  }
+}
+
+uint64_t KapCompactor::EstimateCompactionDebt(DB* db) {
+  ColumnFamilyMetaData cf_meta;
+  db->GetColumnFamilyMetaData(this->ColumnFamily(db), &cf_meta);
+  uint64_t debt = 0;
+  for (auto& cf_level : cf_meta.levels) {
+    for (size_t partition = 0; partition < this->kap_options_.NumPartitions();
+         partition++) {
+      if (cf_level.level == 0 && partition > 0) {
+        continue;
+      }
+      auto level = this->PartitionLevel(cf_level, partition);
+      if (level.files.size() > this->LevelKapacity(level, partition)) {
+        debt += level.size;
+      }
+    }
+  }
+
+  return debt;
+}
+
+bool KapCompactor::L0OverKapacity(DB* db) {
+  ColumnFamilyMetaData cf_meta;
+  db->GetColumnFamilyMetaData(this->ColumnFamily(db), &cf_meta);
+  return cf_meta.levels[0].files.size() >
+         static_cast<size_t>(this->kap_options_.Kapacity(0, 0));
+}
+
+std::vector<std::string> KapCompactor::HotFiles(
+    const rocksdb::LevelMetaData& level) {
+  if (this->access_sketch_ == nullptr || level.level == 0) {
+    return {};
+  }
+  std::vector<std::pair<double, std::string>> hot_files;
+  for (auto& file : level.files) {
+    if (file.being_compacted) {
+      continue;
+    }
+    double heat =
+        this->access_sketch_->RelativeHeat(file.smallestkey, file.largestkey);
+    if (heat >= this->kap_options_.hot_threshold) {
+      hot_files.emplace_back(heat, file.name);
+    }
+  }
+  std::sort(hot_files.begin(), hot_files.end(),
+            [](auto& a, auto& b) { return a.first > b.first; });
+  if (hot_files.size() >
+      static_cast<size_t>(this->kap_options_.hot_kapacity_bonus)) {
+    hot_files.resize(this->kap_options_.hot_kapacity_bonus);
+  }
+  std::vector<std::string> hot_file_names;
+  for (auto& hot : hot_files) {
+    hot_file_names.push_back(hot.second);
+  }
+
+  return hot_file_names;
+}
+
+size_t KapCompactor::LevelKapacity(const rocksdb::LevelMetaData& level,
+                                   size_t partition) {
+  return this->kap_options_.Kapacity(partition, level.level) +
+         this->HotFiles(level).size();
+}
+
+std::vector<std::string> KapCompactor::SeparateHotFiles(
+    const rocksdb::LevelMetaData& level, int kapacity,
+    const std::vector<std::string>& input_file_names) {
+  auto hot_files = this->HotFiles(level);
+  if (level.files.size() <= kapacity + hot_files.size()) {
+    return {};
+  }
+
+  std::vector<std::string> cold_file_names;
+  for (auto& name : input_file_names) {
+    auto is_hot = std::find(hot_files.begin(), hot_files.end(), name) !=
+                  hot_files.end();
+    if (!is_hot) {
+      cold_file_names.push_back(name);
+    }
+  }
+  spdlog::trace("Level {} keeps {} hot files in place", level.level,
+                hot_files.size());
+
+  return cold_file_names;
+}
+
+void KapCompactor::InitAccessSketch(const ColumnFamilyMetaData& cf_meta) {
+  if (this->access_sketch_ == nullptr || cf_meta.file_count == 0) {
+    return;
+  }
+  std::string smallest, largest;
+  for (auto& level : cf_meta.levels) {
+    for (auto& file : level.files) {
+      if (smallest.empty() || file.smallestkey < smallest) {
+        smallest = file.smallestkey;
+      }
+      if (largest.empty() || file.largestkey > largest) {
+        largest = file.largestkey;
+      }
+    }
+  }
+  this->access_sketch_->SetKeyBounds(smallest, largest);
+}
+
+// Order preserving position of a key from the 8 bytes after the first
+// prefix_len bytes, missing bytes count as 0
+static uint64_t KeyPosition(const std::string& key, size_t prefix_len) {
+  uint64_t pos = 0;
+  for (size_t idx = prefix_len; idx < prefix_len + 8; idx++) {
+    pos <<= 8;
+    if (idx < key.size()) {
+      pos |= static_cast<unsigned char>(key[idx]);
+    }
+  }
+  return pos;
+}
+
+double KapCompactor::KeyRangeShare(const ColumnFamilyMetaData& cf_meta,
+                                   size_t partition) {
+  size_t num_partitions = this->kap_options_.NumPartitions();
+  if (num_partitions == 1) {
+    return 1.0;
+  }
+  std::string smallest, largest;
+  for (auto& level : cf_meta.levels) {
+    for (auto& file : level.files) {
+      if (smallest.empty() || file.smallestkey < smallest) {
+        smallest = file.smallestkey;
+      }
+      if (largest.empty() || file.largestkey > largest) {
+        largest = file.largestkey;
+      }
+    }
+  }
+  size_t prefix_len = 0;
+  while (prefix_len < smallest.size() && prefix_len < largest.size() &&
+         smallest[prefix_len] == largest[prefix_len]) {
+    prefix_len++;
+  }
+  uint64_t lower = KeyPosition(smallest, prefix_len);
+  uint64_t upper = KeyPosition(largest, prefix_len);
+  if (upper <= lower) {
+    return 1.0 / num_partitions;
+  }
+
+  // The partition spans [its lower bound, the next lower bound) clipped to
+  // the keys of the tree, the first one also takes every key below its bound
+  uint64_t begin = lower;
+  if (partition > 0) {
+    auto& bound = this->kap_options_.partitions[partition].lower_bound;
+    begin = bound <= smallest ? lower
+            : bound >= largest ? upper
+                               : KeyPosition(bound, prefix_len);
+  }
+  uint64_t end = upper;
+  if (partition + 1 < num_partitions) {
+    auto& bound = this->kap_options_.partitions[partition + 1].lower_bound;
+    end = bound <= smallest ? lower
+          : bound >= largest ? upper
+                             : KeyPosition(bound, prefix_len);
+  }
+  if (end <= begin) {
+    return 0.0;
+  }
+
+  return static_cast<double>(end - begin) / (upper - lower);
+}
+
+uint64_t KapCompactor::CompactionFileSize(const ColumnFamilyMetaData& cf_meta,
+                                          size_t partition, int level) {
+  auto size_ratio = this->kap_options_.SizeRatio(partition);
+  auto file_base = this->rocksdb_options_.target_file_size_base;
+  int k_level = this->kap_options_.Kapacity(partition, level);
+  // Each level is (total_level_size) / (num_file_kapacity) where
+  // total_level_size is equal to m*T^l where l is level, T is size ratio, and m
+  // is the size of the memory buffer. We add +1 since RocksDB starts numbering
+  // levels at 0. Below L0 a partition only holds its share of the key range
+  // of each level, a partition past the keys of the tree falls back to flush
+  // sized files.
+  double share = level == 0 ? 1.0 : this->KeyRangeShare(cf_meta, partition);
+  if (share <= 0) {
+    return file_base;
+  }
+  return (share * file_base * pow(size_ratio, level + 1)) / k_level;
+}
+
 // PickCompaction looks at one paritcular level and checks whether or not the
 // level is full and needs to compact. If no compaction is needed, returns a
 // nullptr
 CompactionTask* KapCompactor::PickCompaction(DB* db, const std::string& cf_name,
-                                             size_t level_idx) {
+                                             size_t level_idx,
+                                             size_t partition) {
+  if ((level_idx == 0 && partition > 0) ||
+      (!cf_name.empty() && cf_name != this->cf_name_)) {
+    return nullptr;
+  }
   ColumnFamilyMetaData cf_meta;
   rocksdb::CompactionOptions opt;
-  db->GetColumnFamilyMetaData(&cf_meta);
-  auto level = cf_meta.levels[level_idx];
-  auto size_ratio = this->rocksdb_options_.target_file_size_multiplier;
-  auto file_base = this->rocksdb_options_.target_file_size_base;
-  int k_level = 1;
-  if (static_cast<size_t>(level.level) < this->kap_options_.kapacities.size()) {
-    k_level = this->kap_options_.kapacities.at(level.level);
-  }
-  // Each level is (total_level_size) / (num_file_kapacity) where
-  // total_level_size is equal to m*T^l where l is level, T is size ratio, and m
-  // is the size of the memory buffer. We add +1 since RocksDB starts numbering
-  // levels at 0.
-  auto file_size = (file_base * pow(size_ratio, level.level + 1)) / k_level;
+  db->GetColumnFamilyMetaData(this->ColumnFamily(db), &cf_meta);
+  auto level = this->PartitionLevel(cf_meta.levels[level_idx], partition);
+  int k_level = this->kap_options_.Kapacity(partition, level.level);
+  auto file_size = this->CompactionFileSize(cf_meta, partition, level.level);
   // Adding an extra ~4% bytes to accomedate for file meta data
   opt.output_file_size_limit = 1.04 * file_size;
-  auto input_file_names = this->CheckIfLevelNeedsCompaction(level);
+  if (this->access_sketch_ != nullptr &&
+      !this->access_sketch_->HasKeyBounds()) {
+    this->InitAccessSketch(cf_meta);
+  }
+  auto input_file_names = this->CheckIfLevelNeedsCompaction(level, partition);
+  auto reason = TaskReason::kKapacity;
+  int output_level = level.level + 1;
+  if (input_file_names.size() < 1 &&
+      this->kap_options_.read_triggered_compaction && level.level == 0) {
+    // Only considered once L0 is within kapacity, so kapacity driven
+    // compactions always take precedence. Deeper levels hold disjoint files,
+    // a read probes a single run there. The runs are merged in place.
+    input_file_names = this->PickReadTriggeredFiles(level);
+    reason = TaskReason::kReadTriggered;
+    output_level = level.level;
+    opt.output_file_size_limit = UINT64_MAX;
+  }
+  if (input_file_names.size() < 1 && this->kap_options_.gc_compaction &&
+      level.level > 0) {
+    // Tombstones are only dropped once nothing older lies below them, so the
+    // last non-empty level is collected in place and any other level is
+    // pushed down early
+    bool bottommost = true;
+    for (size_t below = level_idx + 1; below < cf_meta.levels.size();
+         below++) {
+      bottommost = bottommost && cf_meta.levels[below].files.empty();
+    }
+    rocksdb::LevelMetaData next_level;
+    if (!bottommost) {
+      next_level =
+          this->PartitionLevel(cf_meta.levels[level_idx + 1], partition);
+    }
+    input_file_names =
+        this->PickGarbageFiles(level, bottommost ? nullptr : &next_level);
+    reason = TaskReason::kGarbage;
+    output_level = bottommost ? level.level : level.level + 1;
+    if (bottommost) {
+      opt.output_file_size_limit = UINT64_MAX;
+    }
+  }
+  if (input_file_names.size() < 1 && this->kap_options_.blob_separation &&
+      level.level > 0) {
+    // Kapacity driven compactions relocate old blobs on their way through, so
+    // the runs are only rewritten in place for their blobs when nothing else
+    // is due
+    input_file_names = this->PickBlobGarbageFiles(cf_meta, level);
+    reason = TaskReason::kBlobGarbage;
+    output_level = level.level;
+    opt.output_file_size_limit = UINT64_MAX;
+  }
   if (input_file_names.size() < 1) {
     return nullptr;
   }
+  if (this->access_sketch_ != nullptr && level.level > 0 &&
+      reason == TaskReason::kKapacity) {
+    // L0 always drains fully since it holds back foreground writes
+    input_file_names =
+        this->SeparateHotFiles(level, k_level, input_file_names);
+    if (input_file_names.size() < 1) {
+      return nullptr;
+    }
+  }
+
+  if (level.level == 0 && reason == TaskReason::kKapacity &&
+      this->kap_options_.intra_l0_compaction &&
+      this->LevelIsBusy(cf_meta.levels[1])) {
+    // L1 is held by another compaction so an L0 -> L1 merge would fail. We
+    // instead merge the free L0 runs into a single L0 run to bring the file
+    // count (and the write stall risk) down until L1 frees up.
+    input_file_names = this->PickIntraL0Files(level);
+    if (input_file_names.size() <
+        static_cast<size_t>(this->kap_options_.intra_l0_min_files)) {
+      return nullptr;
+    }
+    output_level = 0;
+    reason = TaskReason::kIntraL0;
+    opt.output_file_size_limit = UINT64_MAX;
+    spdlog::trace("L1 busy, picking intra-L0 compaction of {} files",
+                  input_file_names.size());
+  }
 
-  return new CompactionTask(db, this, cf_name, input_file_names,
-                            level.level + 1, level.level, opt, false);
+  size_t grandparent_level = output_level + 1;
+  if (this->kap_options_.grandparent_alignment &&
+      grandparent_level < cf_meta.levels.size()) {
+    this->partitioner_factory_->SetLevelBoundaries(
+        cf_meta.levels[grandparent_level]);
+  }
+
+  auto task = new CompactionTask(db, this, cf_name, input_file_names,
+                                 output_level, level.level, opt, false);
+  task->partition = partition;
+  task->reason = reason;
+
+  return task;
 }
 
 // Schedule the specified compaction task in background.
 void KapCompactor::ScheduleCompaction(CompactionTask* task) {
-  spdlog::trace("Scheduling compaction {} -> {}", task->input_level,
-                task->output_level);
+  if (this->canceled_.load()) {
+    delete task;
+    return;
+  }
+  spdlog::trace("Scheduling compaction {} -> {} of column family {}",
+                task->input_level, task->output_level, this->cf_name_);
+  task->column_family_name = this->cf_name_;
+  task->column_family = this->ColumnFamily(task->db);
+  task->output_path_id =
+      this->kap_options_.StoragePathOf(task->output_level);
+  task->output_dir =
+      task->output_path_id >= 0
+          ? this->kap_options_.storage_paths[task->output_path_id].path
+          : task->db->GetName();
+  task->remote = this->kap_options_.remote_compaction &&
+                 task->output_level >=
+                     this->kap_options_.remote_min_output_level;
   this->compaction_task_count_++;
-  rocksdb_options_.env->Schedule(&KapCompactor::CompactFiles, task);
+  this->scheduled_by_reason_[static_cast<int>(task->reason)]++;
+  if (task->reason == TaskReason::kReadTriggered) {
+    this->read_triggered_in_flight_++;
+  } else if (task->reason == TaskReason::kGarbage) {
+    this->gc_in_flight_++;
+  } else if (task->reason == TaskReason::kBlobGarbage) {
+    this->blob_gc_in_flight_++;
+  }
+  this->scheduler_->Submit(this, task);
+}
+
+int KapCompactor::ReconcileTree(DB* db, bool wait_for_kapacity) {
+  size_t num_levels = this->rocksdb_options_.num_levels;
+  size_t num_partitions = this->kap_options_.NumPartitions();
+  int scheduled = 0;
+  while (!this->CheckTreeKapacities(db)) {
+    rocksdb::ColumnFamilyMetaData cf_meta;
+    db->GetColumnFamilyMetaData(this->ColumnFamily(db), &cf_meta);
+    size_t l0_files = cf_meta.levels[0].files.size();
+    if (!wait_for_kapacity &&
+        l0_files <
+            static_cast<size_t>(
+                this->rocksdb_options_.level0_slowdown_writes_trigger)) {
+      break;
+    }
+
+    // A task claims its input and output level (within its partition, L0 is
+    // shared and its output claims every partition of L1) so no two tasks of
+    // a wave compete for the same files
+    std::vector<std::vector<bool>> claimed(
+        num_levels, std::vector<bool>(num_partitions, false));
+    int wave = 0;
+    for (size_t level_idx = 0; level_idx < num_levels - 1; level_idx++) {
+      for (size_t partition = 0; partition < num_partitions; partition++) {
+        if (claimed[level_idx][partition] ||
+            claimed[level_idx + 1][partition]) {
+          continue;
+        }
+        CompactionTask* task =
+            this->PickCompaction(db, "", level_idx, partition);
+        if (task == nullptr) {
+          continue;
+        }
+        claimed[level_idx][partition] = true;
+        if (level_idx == 0) {
+          std::fill(claimed[1].begin(), claimed[1].end(), true);
+        } else {
+          claimed[level_idx + 1][partition] = true;
+        }
+        this->ScheduleCompaction(task);
+        wave++;
+      }
+    }
+    if (wave == 0) {
+      spdlog::warn("Unable to reconcile tree, no compaction could be picked");
+      break;
+    }
+    spdlog::debug("Reconciling tree with {} compactions (L0 files: {})", wave,
+                  l0_files);
+    scheduled += wave;
+    this->WaitForCompactions();
+  }
+
+  return scheduled;
+}
+
+void KapCompactor::CancelAllCompactions(DB* db) {
+  this->canceled_.store(true);
+  auto queued = this->scheduler_->Drain(this);
+  for (auto task : queued) {
+    this->CompactionTaskFinished(
+        *task, rocksdb::Status::Aborted("Compaction canceled"),
+        CompactionJobInfo());
+    this->DecrementCompactionTaskCount();
+    delete task;
+  }
+  int dropped = this->rocksdb_options_.env->UnSchedule(
+      this, rocksdb::Env::Priority::LOW);
+  // Running CompactFiles jobs check the manual compaction pause flag and
+  // stop early with Status::Incomplete. The flag is DB wide, so it is only
+  // raised by the last compactor to cancel, the jobs of a column family
+  // canceled before run to completion without pausing the others.
+  if (this->scheduler_->AllCanceled()) {
+    db->DisableManualCompaction();
+    this->paused_db_ = true;
+  }
+  this->WaitForCompactions();
+  db->WaitForCompact(rocksdb::WaitForCompactOptions());
+  spdlog::debug("Canceled compactions, dropped {} queued tasks",
+                queued.size() + dropped);
+}
+
+void KapCompactor::ResumeCompactions(DB* db) {
+  if (this->paused_db_) {
+    db->EnableManualCompaction();
+    this->paused_db_ = false;
+  }
+  this->canceled_.store(false);
+}
+
+void KapCompactor::UnscheduleCompaction(void* arg) {
+  std::unique_ptr<CompactionTask> task(static_cast<CompactionTask*>(arg));
+  task->compactor->CompactionTaskFinished(
+      *task, rocksdb::Status::Aborted("Compaction unscheduled"),
+      CompactionJobInfo());
+  task->compactor->DecrementCompactionTaskCount();
+  task->compactor->CompactionTaskDone();
+}
+
+void KapCompactor::CompactionTaskFailed(const CompactionTask& task,
+                                        const rocksdb::Status& s,
+                                        const CompactionJobInfo& info) {
+  this->wasted_bytes_ += info.stats.total_input_bytes;
+  // Canceled or paused compactions fail right away until resumed, retrying
+  // would only spin
+  if (this->canceled_.load() || s.IsIOError() || s.IsIncomplete()) {
+    return;
+  }
+
+  // CompactFiles rejects inputs held by a running compaction (Aborted) and
+  // inputs that no longer exist (InvalidArgument) before doing any work. Any
+  // other InvalidArgument (e.g. a bad output level) would fail again as is.
+  if (s.IsInvalidArgument() && !this->InputsMissing(task)) {
+    spdlog::warn("Compaction of L{} partition {} rejected: {}",
+                 task.input_level, task.partition, s.ToString());
+    return;
+  }
+  if (s.IsAborted() || s.IsInvalidArgument()) {
+    this->conflicts_++;
+    int attempts = 0;
+    {
+      std::lock_guard<std::mutex> lock(this->retry_mutex_);
+      attempts = ++this->conflict_attempts_[{task.input_level, task.partition}];
+      if (attempts <= kMaxConflictRetries) {
+        this->retry_queue_.emplace(task.input_level, task.partition);
+      }
+    }
+    if (attempts > kMaxConflictRetries) {
+      spdlog::warn("Giving up on L{} partition {} after {} conflicts",
+                   task.input_level, task.partition, attempts - 1);
+    }
+    return;
+  }
+
+  if (task.retry_on_fail) {
+    CompactionTask* new_task =
+        this->PickCompaction(task.db, "", task.input_level, task.partition);
+    if (new_task != nullptr) {
+      this->retries_++;
+      this->ScheduleCompaction(new_task);
+    }
+  }
+}
+
+bool KapCompactor::InputsMissing(const CompactionTask& task) {
+  rocksdb::ColumnFamilyMetaData cf_meta;
+  task.db->GetColumnFamilyMetaData(this->ColumnFamily(task.db), &cf_meta);
+  std::set<std::string> live;
+  for (auto& level : cf_meta.levels) {
+    for (auto& file : level.files) {
+      live.insert(file.name);
+    }
+  }
+  for (auto& name : task.input_file_names) {
+    if (live.count(name) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void KapCompactor::RetryConflictedCompactions(DB* db) {
+  std::set<std::pair<int, size_t>> pending;
+  {
+    std::lock_guard<std::mutex> lock(this->retry_mutex_);
+    pending.swap(this->retry_queue_);
+  }
+  for (auto& [level_idx, partition] : pending) {
+    CompactionTask* task = this->PickCompaction(db, "", level_idx, partition);
+    if (task != nullptr) {
+      spdlog::trace("Retrying compaction of L{} partition {}", level_idx,
+                    partition);
+      this->retries_++;
+      this->ScheduleCompaction(task);
+    }
+  }
+}
+
+void KapCompactor::CompactionTaskFinished(const CompactionTask& task,
+                                          const rocksdb::Status& s,
+                                          const CompactionJobInfo& info) {
+  if (task.reason == TaskReason::kReadTriggered) {
+    this->read_triggered_in_flight_--;
+  } else if (task.reason == TaskReason::kGarbage) {
+    this->gc_in_flight_--;
+  } else if (task.reason == TaskReason::kBlobGarbage) {
+    this->blob_gc_in_flight_--;
+  }
+  if (!s.ok()) {
+    this->CompactionTaskFailed(task, s, info);
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(this->retry_mutex_);
+    this->conflict_attempts_.erase({task.input_level, task.partition});
+  }
+  this->compaction_sst_bytes_ += info.stats.total_output_bytes;
+  this->compaction_blob_bytes_ += info.stats.total_output_bytes_blob;
+  this->compaction_output_records_ += info.stats.num_output_records;
+  if (info.stats.num_input_records == 0) {
+    return;
+  }
+
+  if (task.reason == TaskReason::kGarbage) {
+    if (info.stats.total_input_bytes > info.stats.total_output_bytes) {
+      this->gc_reclaimed_bytes_ +=
+          info.stats.total_input_bytes - info.stats.total_output_bytes;
+    }
+    if (info.stats.num_input_records > info.stats.num_output_records) {
+      this->gc_reclaimed_records_ +=
+          info.stats.num_input_records - info.stats.num_output_records;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(this->overwrite_mutex_);
+  // A level pushed down is empty afterwards, only a collection in place
+  // leaves the same entries behind for the next pick to look at
+  if (task.reason == TaskReason::kGarbage &&
+      task.output_level == task.input_level &&
+      info.stats.num_output_records >= info.stats.num_input_records) {
+    if (static_cast<size_t>(task.input_level) >=
+        this->gc_unproductive_entries_.size()) {
+      this->gc_unproductive_entries_.resize(task.input_level + 1, 0);
+    }
+    this->gc_unproductive_entries_[task.input_level] =
+        info.stats.num_output_records;
+  }
+  // Only merges into the next level tell how much of L replaces L+1
+  if (task.output_level != task.input_level + 1) {
+    return;
+  }
+  // Smooth the overwrite ratio so one skewed compaction does not flip GC
+  double ratio = static_cast<double>(info.stats.num_records_replaced) /
+                 info.stats.num_input_records;
+  if (static_cast<size_t>(task.input_level) >= this->overwrite_ratio_.size()) {
+    this->overwrite_ratio_.resize(task.input_level + 1, ratio);
+  }
+  this->overwrite_ratio_[task.input_level] =
+      0.75 * this->overwrite_ratio_[task.input_level] + 0.25 * ratio;
 }
 
 void KapCompactor::CompactFiles(void* arg) {
   std::unique_ptr<CompactionTask> task(static_cast<CompactionTask*>(arg));
   assert(task);
   assert(task->db);
-  rocksdb::Status s = task->db->CompactFiles(
-      task->compact_options, task->input_file_names, task->output_level);
+  CompactionJobInfo info;
+  rocksdb::Status s;
+  if (task->compactor->CompactionsCanceled()) {
+    s = rocksdb::Status::Aborted("Compactions canceled");
+  } else {
+    KapCompactionService::SetOffloadCurrentThread(
+        task->remote, task->column_family->GetName(), task->output_dir);
+    s = task->db->CompactFiles(task->compact_options, task->column_family,
+                               task->input_file_names, task->output_level,
+                               task->output_path_id, nullptr, &info);
+    KapCompactionService::SetOffloadCurrentThread(false);
+  }
   spdlog::trace("CompactFiles() finished with status {}", s.ToString());
+  // Retries of failed tasks are picked in CompactionTaskFinished
+  task->compactor->CompactionTaskFinished(*task, s, info);
   task->compactor->DecrementCompactionTaskCount();
-  if (!s.ok() && !s.IsIOError() && task->retry_on_fail) {
-    // If a compaction task with its retry_on_fail=true failed,
-    // try to schedule another compaction in case the reason
-    // is not an IO error.
-    CompactionTask* new_task = task->compactor->PickCompaction(
-        task->db, task->column_family_name, task->input_level);
-    task->compactor->ScheduleCompaction(new_task);
-  }
+  task->compactor->CompactionTaskDone();
 }
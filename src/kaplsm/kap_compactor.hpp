@@ -1,13 +1,24 @@
 #pragma once
 
+#include <array>
 #include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
 
+#include "access_sketch.hpp"
 #include "kap_options.hpp"
+#include "kap_partitioner.hpp"
+#include "kap_scheduler.hpp"
 #include "rocksdb/db.h"
 #include "rocksdb/listener.h"
 #include "rocksdb/metadata.h"
 #include "rocksdb/options.h"
+#include "rocksdb/statistics.h"
 
 using ROCKSDB_NAMESPACE::CompactionJobInfo;
 using ROCKSDB_NAMESPACE::CompactionOptions;
@@ -22,18 +33,62 @@ struct CompactionTask;
 class Compactor : public EventListener {
  public:
   // Picks and returns a compaction task given the specified DB
-  // and column family.  It is the caller's responsibility to
+  // and column family (empty for the compactor's own column family).
+  // It is the caller's responsibility to
   // destroy the returned CompactionTask.  Returns "nullptr"
   // if it cannot find a proper compaction task.
   virtual CompactionTask* PickCompaction(DB* db, const std::string& cf_name,
-                                         size_t level_idx) = 0;
+                                         size_t level_idx,
+                                         size_t partition) = 0;
 
   // Schedule and run the specified compaction task in background.
   virtual void ScheduleCompaction(CompactionTask* task) = 0;
 
   virtual void DecrementCompactionTaskCount() = 0;
+
+  // True once compactions were canceled, queued tasks then exit right away
+  virtual bool CompactionsCanceled() = 0;
+
+  // Frees the pool slot of a task that ran or was unscheduled
+  virtual void CompactionTaskDone() = 0;
+
+  // Called from the background thread once a task has run, successful or not
+  virtual void CompactionTaskFinished(const CompactionTask& task,
+                                      const rocksdb::Status& s,
+                                      const CompactionJobInfo& info) = 0;
+};
+
+// Why a compaction task was picked
+enum class TaskReason : int {
+  kKapacity = 0,
+  kIntraL0,
+  kReadTriggered,
+  kGarbage,
+  kIdle,
+  kBlobGarbage,
+  kNumReasons
 };
 
+// Order of tasks within a compactor's queue, lowest first. Kapacity driven
+// tasks keep the tree within its kapacities (and L0 below the write stall
+// triggers), read triggered merges cut the cost of foreground reads, and the
+// garbage and idle compactions are only worth their I/O once nothing else
+// waits.
+inline int TaskPriority(TaskReason reason) {
+  switch (reason) {
+    case TaskReason::kKapacity:
+    case TaskReason::kIntraL0:
+      return 0;
+    case TaskReason::kReadTriggered:
+      return 1;
+    case TaskReason::kGarbage:
+    case TaskReason::kBlobGarbage:
+      return 2;
+    default:
+      return 3;
+  }
+}
+
 struct CompactionTask {
   CompactionTask(DB* _db, Compactor* _compactor,
                  const std::string& _column_family_name,
@@ -50,59 +105,303 @@ struct CompactionTask {
         retry_on_fail(_retry_on_fail) {}
   DB* db;
   Compactor* compactor;
-  const std::string& column_family_name;
+  std::string column_family_name;
+  rocksdb::ColumnFamilyHandle* column_family = nullptr;
   std::vector<std::string> input_file_names;
   int output_level;
   int input_level;
   rocksdb::CompactionOptions compact_options;
   bool retry_on_fail;
+  size_t partition = 0;
+  TaskReason reason = TaskReason::kKapacity;
+  // Run through the DB's compaction service instead of in process
+  bool remote = false;
+  // Storage path of the outputs, -1 lets RocksDB choose
+  int output_path_id = -1;
+  // Directory the outputs end up in, where remote jobs are staged
+  std::string output_dir;
 };
 
+// Compacts one column family of a DB following its KapOptions. Compactors of
+// different column families share the event thread and the thread pool
+// through a common KapScheduler, without one each compactor owns its own.
 class KapCompactor : public Compactor {
  public:
   KapCompactor(const rocksdb::Options rocksdb_options,
-               const KapOptions kap_options)
-      : rocksdb_options_(rocksdb_options), kap_options_(kap_options) {
+               const KapOptions kap_options,
+               std::string cf_name = rocksdb::kDefaultColumnFamilyName,
+               std::shared_ptr<KapScheduler> scheduler = nullptr)
+      : rocksdb_options_(rocksdb_options),
+        kap_options_(kap_options),
+        cf_name_(std::move(cf_name)),
+        scheduler_(std::move(scheduler)) {
     compact_options_.compression = rocksdb_options_.compression;
     compact_options_.output_file_size_limit = UINT64_MAX;
+    if (kap_options_.hot_cold_separation) {
+      // Decay roughly every time each bucket has seen 64 accesses
+      access_sketch_ = std::make_shared<AccessSketch>(
+          kap_options_.sketch_buckets, 64 * kap_options_.sketch_buckets);
+    }
+    if (kap_options_.grandparent_alignment ||
+        kap_options_.hot_cold_separation ||
+        kap_options_.partitions.size() > 1) {
+      // Outputs smaller than one flush are not worth the extra file
+      partitioner_factory_ = std::make_shared<KapPartitionerFactory>(
+          kap_options_.buffer_size, kap_options_.max_grandparent_overlap);
+      partitioner_factory_->SetAccessSketch(access_sketch_,
+                                            kap_options_.hot_threshold);
+      std::vector<std::string> partition_bounds;
+      for (size_t idx = 1; idx < kap_options_.partitions.size(); idx++) {
+        partition_bounds.push_back(kap_options_.partitions[idx].lower_bound);
+      }
+      partitioner_factory_->SetPartitionBounds(partition_bounds);
+    }
+    if (scheduler_ == nullptr) {
+      scheduler_ = std::make_shared<KapScheduler>(rocksdb_options_.env);
+    }
+    scheduler_->Register(this);
+    scheduler_->Start();
   }
 
-  ~KapCompactor() {}
+  ~KapCompactor() { scheduler_->Unregister(this); }
 
+  // Both callbacks only queue an event for the compactor's column family,
+  // picking runs on the scheduler thread so flush and compaction threads go
+  // straight back to RocksDB
   void OnFlushCompleted(DB* db, const FlushJobInfo& info) override;
   void OnCompactionCompleted(DB* db, const CompactionJobInfo& info) override;
 
+  // Runs the pick passes for a batch of events, on the scheduler thread
+  void HandleEvents(const std::vector<CompactorEvent>& events);
+
+  // Handle of the column family once the DB is open, the default column
+  // family is used when it is not set
+  void SetColumnFamilyHandle(rocksdb::ColumnFamilyHandle* column_family) {
+    column_family_ = column_family;
+  }
+
+  rocksdb::ColumnFamilyHandle* ColumnFamily(DB* db) {
+    return column_family_ != nullptr ? column_family_
+                                     : db->DefaultColumnFamily();
+  }
+
+  const std::string& GetColumnFamilyName() { return cf_name_; }
+  const KapOptions& GetKapOptions() { return kap_options_; }
+  std::shared_ptr<KapScheduler> GetScheduler() { return scheduler_; }
+
+  // Pick passes run for flush and compaction events
+  void PickAfterFlush(DB* db, bool triggered_writes_stop);
+  void PickAfterCompaction(DB* db);
+
   CompactionTask* PickCompaction(DB* db, const std::string& cf_name,
-                                 size_t level_idx) override;
+                                 size_t level_idx) {
+    return PickCompaction(db, cf_name, level_idx, 0);
+  }
+
+  // Picks a compaction for the files of one key range partition within the
+  // level. L0 is shared by all partitions and is only picked for partition 0.
+  CompactionTask* PickCompaction(DB* db, const std::string& cf_name,
+                                 size_t level_idx, size_t partition) override;
 
   void ScheduleCompaction(CompactionTask* task) override;
 
   std::vector<std::string> CheckIfLevelNeedsCompaction(
-      rocksdb::LevelMetaData level);
+      rocksdb::LevelMetaData level, size_t partition = 0);
+
+  // Restricts the level to the files of one key range partition
+  rocksdb::LevelMetaData PartitionLevel(const rocksdb::LevelMetaData& level,
+                                        size_t partition);
+
+  // Returns the newest contiguous run of free L0 files, which is the only set
+  // of L0 files that can be merged back into L0 without reordering sequence
+  // numbers, cut before it grows past intra_l0_max_size bytes
+  std::vector<std::string> PickIntraL0Files(rocksdb::LevelMetaData level);
+
+  // Picks the free L0 runs overlapping the most read L0 file while L0 is
+  // within its kapacity, as long as merging them saves at least
+  // read_compaction_threshold filter probes and I/Os. L0 is the only level
+  // whose runs overlap, files of deeper levels are disjoint. The pick starts
+  // at the newest run so the merged run can stay in L0. At most one read
+  // triggered compaction runs at a time.
+  std::vector<std::string> PickReadTriggeredFiles(
+      const rocksdb::LevelMetaData& level);
+
+  // Picks all files of a level once their estimated garbage reaches
+  // gc_garbage_ratio of the entries the collection merges. next_level is the
+  // level below the files are pushed into, nullptr when the level is the last
+  // non-empty one and is collected in place. In place only the tombstones are
+  // garbage, pushed down the entries of both levels are expected to be
+  // replaced at the overwrite ratio learned from past merges into L+1.
+  // Levels with a file already being compacted are skipped so collection
+  // never drops tombstones that still shadow a file left behind.
+  std::vector<std::string> PickGarbageFiles(
+      const rocksdb::LevelMetaData& level,
+      const rocksdb::LevelMetaData* next_level);
+
+  // Picks the free runs of a level that still reference the oldest
+  // blob_gc_age_cutoff fraction of blob files once the garbage in those blob
+  // files reaches blob_gc_force_threshold. Rewriting the runs relocates their
+  // live blobs so the old blob files can be dropped. At most one blob
+  // collecting compaction runs at a time.
+  std::vector<std::string> PickBlobGarbageFiles(
+      const rocksdb::ColumnFamilyMetaData& cf_meta,
+      const rocksdb::LevelMetaData& level);
+
+  // Bytes written by compactions into SST and blob files, and the entries
+  // they wrote, from which run_db estimates the bytes a compaction would
+  // have written without key-value separation
+  uint64_t GetCompactionSstBytes() { return compaction_sst_bytes_.load(); }
+  uint64_t GetCompactionBlobBytes() { return compaction_blob_bytes_.load(); }
+  uint64_t GetCompactionOutputRecords() {
+    return compaction_output_records_.load();
+  }
+
+  // Bytes and records dropped by garbage collecting compactions so far
+  uint64_t GetReclaimedBytes() { return gc_reclaimed_bytes_.load(); }
+  uint64_t GetReclaimedRecords() { return gc_reclaimed_records_.load(); }
+
+  // Tasks whose input files were already taken by another compaction (or
+  // compacted away since they were picked) are parked per (level, partition)
+  // and re-picked by the event thread with the next flush or compaction
+  // event. A (level, partition) that keeps conflicting is dropped after a few
+  // tries.
+  void RetryConflictedCompactions(DB* db);
+
+  // Tasks that found their files in use, tasks re-picked after a failure and
+  // input bytes read by tasks that failed midway
+  uint64_t GetConflictCount() { return conflicts_.load(); }
+  uint64_t GetRetryCount() { return retries_.load(); }
+  uint64_t GetWastedBytes() { return wasted_bytes_.load(); }
+
+  // Schedules one idle compaction when foreground traffic across the DB is
+  // below idle_ops_threshold ops/sec and no other compaction is queued.
+  // Called by the KapScheduler maintenance thread.
+  void ScheduleIdleCompaction(DB* db, double ops_per_sec);
+
+  // Bytes held by levels (or partitions of a level) that exceed their
+  // kapacity and still have to be compacted
+  uint64_t EstimateCompactionDebt(DB* db);
+
+  // True while L0 holds more runs than its kapacity, which ends in a write
+  // stall if compactions fall behind
+  bool L0OverKapacity(DB* db);
+
+  // Foreground reads and writes counted by RecordAccess so far
+  uint64_t GetForegroundOps() {
+    return foreground_ops_.load(std::memory_order_relaxed);
+  }
+
+  // Picks the oldest free runs of the level holding the oldest data among
+  // the levels at or one run short of their kapacity whose next level stays
+  // within its kapacity after the merge, so the merge does not cascade.
+  // Returns nullptr when there is no such level.
+  CompactionTask* PickIdleCompaction(DB* db);
+
+  // Fraction of the key range of the tree covered by the partition
+  double KeyRangeShare(const rocksdb::ColumnFamilyMetaData& cf_meta,
+                       size_t partition);
+
+  // Size of the output files of a compaction out of the level
+  uint64_t CompactionFileSize(const rocksdb::ColumnFamilyMetaData& cf_meta,
+                              size_t partition, int level);
+
+  // Up to hot_kapacity_bonus of the hottest free files of a level below L0,
+  // hottest first, empty without hot/cold separation
+  std::vector<std::string> HotFiles(const rocksdb::LevelMetaData& level);
+
+  // Files the (partition of the) level may hold: its kapacity plus the hot
+  // files SeparateHotFiles keeps in place on top of it
+  size_t LevelKapacity(const rocksdb::LevelMetaData& level, size_t partition);
+
+  // Removes up to hot_kapacity_bonus of the hottest files from the inputs so
+  // hot key ranges stay in the level. Returns no inputs when the level fits
+  // within its kapacity plus the retained hot files.
+  std::vector<std::string> SeparateHotFiles(
+      const rocksdb::LevelMetaData& level, int kapacity,
+      const std::vector<std::string>& input_file_names);
+
+  // Counts a foreground read or write and feeds it into the access sketch
+  // used for hot/cold separation
+  void RecordAccess(const rocksdb::Slice& key) {
+    foreground_ops_.fetch_add(1, std::memory_order_relaxed);
+    if (access_sketch_ != nullptr) {
+      access_sketch_->Record(key);
+    }
+  }
+
+  // Bounds the access sketch by the smallest and largest key in the tree,
+  // widening the bounds once keys go past them
+  void InitAccessSketch(DB* db) {
+    rocksdb::ColumnFamilyMetaData cf_meta;
+    db->GetColumnFamilyMetaData(ColumnFamily(db), &cf_meta);
+    InitAccessSketch(cf_meta);
+  }
+
+  void InitAccessSketch(const rocksdb::ColumnFamilyMetaData& cf_meta);
+
+  bool LevelIsBusy(const rocksdb::LevelMetaData& level) {
+    for (auto& file : level.files) {
+      if (file.being_compacted) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Factory to install as rocksdb::Options::sst_partitioner_factory before
+  // opening the DB, nullptr when grandparent alignment is disabled
+  std::shared_ptr<KapPartitionerFactory> GetPartitionerFactory() {
+    return partitioner_factory_;
+  }
 
   int GetCompactionTaskCount() { return compaction_task_count_.load(); }
 
   void DecrementCompactionTaskCount() override { compaction_task_count_--; }
 
+  void CompactionTaskFinished(const CompactionTask& task,
+                              const rocksdb::Status& s,
+                              const CompactionJobInfo& info) override;
+
+  // Number of compaction tasks scheduled so far for the given reason
+  uint64_t GetScheduledCompactionCount(TaskReason reason) {
+    return scheduled_by_reason_[static_cast<int>(reason)].load();
+  }
+
+  // Stops all compaction work of the column family for shutdown: queued
+  // tasks are dropped from the thread pool and no new task is scheduled.
+  // RocksDB can only pause CompactFiles for the whole DB, so running jobs are
+  // aborted once every compactor of the scheduler is canceled, until then
+  // they are waited on. Returns once every task has finished and RocksDB has
+  // no background work left.
+  void CancelAllCompactions(DB* db);
+
+  // Allows scheduling again after CancelAllCompactions
+  void ResumeCompactions(DB* db);
+
+  bool CompactionsCanceled() override { return canceled_.load(); }
+
+  void CompactionTaskDone() override { scheduler_->TaskDone(); }
+
+  // Waits until no task runs and the scheduler has no event left to pick from
   void WaitForCompactions() {
-    while (compaction_task_count_.load() > 0) {
+    while (compaction_task_count_.load() > 0 ||
+           (scheduler_->Running() && pending_events_.load() > 0)) {
       std::this_thread::sleep_for(std::chrono::milliseconds(100));
     }
   }
 
   bool CheckTreeKapacities(DB* db) {
     rocksdb::ColumnFamilyMetaData cf_meta;
-    db->GetColumnFamilyMetaData(&cf_meta);
+    db->GetColumnFamilyMetaData(ColumnFamily(db), &cf_meta);
     for (size_t level_idx = 0;
          level_idx < static_cast<size_t>(this->rocksdb_options_.num_levels);
          level_idx++) {
-      auto level = cf_meta.levels[level_idx];
-      int kapacity = 1;
-      if (level_idx < this->kap_options_.kapacities.size()) {
-        kapacity = this->kap_options_.kapacities[level_idx];
-      }
-      if (level.files.size() > static_cast<size_t>(kapacity)) {
-        return false;
+      for (size_t partition = 0;
+           partition < this->kap_options_.NumPartitions(); partition++) {
+        auto level = PartitionLevel(cf_meta.levels[level_idx], partition);
+        if (level.files.size() > LevelKapacity(level, partition)) {
+          return false;
+        }
       }
     }
     return true;
@@ -113,22 +412,78 @@ class KapCompactor : public Compactor {
     for (size_t level_idx = 0;
          level_idx < static_cast<size_t>(this->rocksdb_options_.num_levels) - 1;
          level_idx++) {
-      CompactionTask* task = PickCompaction(db, "", level_idx);
-      if (task != nullptr) {
-        ScheduleCompaction(task);
-        had_to_schedule = true;
+      for (size_t partition = 0;
+           partition < this->kap_options_.NumPartitions(); partition++) {
+        CompactionTask* task = PickCompaction(db, "", level_idx, partition);
+        if (task != nullptr) {
+          ScheduleCompaction(task);
+          had_to_schedule = true;
+        }
       }
     }
     return had_to_schedule;
   }
 
+  // Brings a reopened tree back within its kapacities. Compactions are
+  // scheduled in waves of tasks that touch disjoint levels (top down, so L0 is
+  // drained first) and each wave is waited on before the next is picked.
+  // Unless wait_for_kapacity is set, returns as soon as L0 is below the write
+  // slowdown trigger and leaves the deeper levels to the regular flush and
+  // compaction events. Returns the number of tasks scheduled.
+  int ReconcileTree(DB* db, bool wait_for_kapacity = false);
+
   static void CompactFiles(void* arg);
 
+  // Counts the failure, parks conflicting tasks for RetryConflictedCompactions
+  // and re-picks other failed tasks right away when they ask for a retry
+  void CompactionTaskFailed(const CompactionTask& task,
+                            const rocksdb::Status& s,
+                            const CompactionJobInfo& info);
+
+  // Drops a task removed from the thread pool queue before it ran
+  static void UnscheduleCompaction(void* arg);
+
  private:
+  // True if some input of the task is no longer part of the tree
+  bool InputsMissing(const CompactionTask& task);
+
   rocksdb::Options rocksdb_options_;
   KapOptions kap_options_;
+  std::string cf_name_;
+  rocksdb::ColumnFamilyHandle* column_family_ = nullptr;
+  std::shared_ptr<KapScheduler> scheduler_;
   CompactionOptions compact_options_;
   std::atomic<int> compaction_task_count_{0};
+  std::atomic<bool> canceled_{false};
+  std::atomic<int> read_triggered_in_flight_{0};
+  std::atomic<uint64_t> foreground_ops_{0};
+  std::atomic<int> pending_events_{0};
+  // Set while this compactor holds the DB wide manual compaction pause
+  bool paused_db_ = false;
+  std::atomic<int> gc_in_flight_{0};
+  std::atomic<uint64_t> gc_reclaimed_bytes_{0};
+  std::atomic<uint64_t> gc_reclaimed_records_{0};
+  std::atomic<int> blob_gc_in_flight_{0};
+  std::atomic<uint64_t> compaction_sst_bytes_{0};
+  std::atomic<uint64_t> compaction_blob_bytes_{0};
+  std::atomic<uint64_t> compaction_output_records_{0};
+  // Fraction of input records replaced by newer versions in merges of a
+  // level into the next one, per input level
+  std::mutex overwrite_mutex_;
+  std::vector<double> overwrite_ratio_;
+  // Entries of a level when GC last reclaimed nothing (e.g. tombstones kept
+  // alive by a snapshot), the level is left alone until its contents change
+  std::vector<uint64_t> gc_unproductive_entries_;
+  std::array<std::atomic<uint64_t>, static_cast<int>(TaskReason::kNumReasons)>
+      scheduled_by_reason_{};
+  std::mutex retry_mutex_;
+  std::set<std::pair<int, size_t>> retry_queue_;
+  std::map<std::pair<int, size_t>, int> conflict_attempts_;
+  std::atomic<uint64_t> conflicts_{0};
+  std::atomic<uint64_t> retries_{0};
+  std::atomic<uint64_t> wasted_bytes_{0};
+  std::shared_ptr<KapPartitionerFactory> partitioner_factory_;
+  std::shared_ptr<AccessSketch> access_sketch_;
 };
 
 }  // namespace kaplsm
@@ -2,6 +2,7 @@
 
 #include <spdlog/spdlog.h>
 
+#include <algorithm>
 #include <cstdint>
 #include <fstream>
 #include <limits>
@@ -11,6 +12,22 @@
 
 namespace kaplsm {
 
+// Size ratio and kapacities for the keys in [lower_bound, lower_bound of the
+// next partition). L0 is shared by all partitions and always follows the
+// global kapacities.
+struct KeyRangePolicy {
+  std::string lower_bound;
+  int size_ratio = 2;
+  std::vector<int> kapacities;
+};
+
+// Directory holding every level from first_level down to the first_level of
+// the next storage path
+struct StoragePath {
+  std::string path;
+  int first_level = 0;
+};
+
 class KapOptions {
  public:
   int size_ratio = 2;
@@ -22,6 +39,67 @@ class KapOptions {
   uint64_t fixed_file_size = std::numeric_limits<uint64_t>::max();
   unsigned long num_keys = 0;
   unsigned int levels = 0;
+  // Merge free L0 runs into a single L0 run while L1 is busy compacting, the
+  // merged run holding at most intra_l0_max_size bytes (0 caps it at
+  // size_ratio buffers, the data of one classic L0)
+  bool intra_l0_compaction = false;
+  int intra_l0_min_files = 2;
+  uint64_t intra_l0_max_size = 0;
+  // Cut compaction outputs at the file boundaries of level L+2, closing an
+  // output once it overlaps max_grandparent_overlap grandparent files
+  bool grandparent_alignment = false;
+  int max_grandparent_overlap = 1;
+  // Split outputs into hot and cold files using an access sketch built from
+  // reads and writes. Up to hot_kapacity_bonus files whose heat is at least
+  // hot_threshold times the mean stay in their level beyond its kapacity.
+  bool hot_cold_separation = false;
+  double hot_threshold = 2.0;
+  int hot_kapacity_bonus = 1;
+  int sketch_buckets = 1024;
+  // Merge the overlapping L0 runs under a read hot range into one L0 run once
+  // the extra probes they cost (from RocksDB's sampled per file read counts)
+  // reach read_compaction_threshold
+  bool read_triggered_compaction = false;
+  uint64_t read_compaction_threshold = 1 << 16;
+  // Compact runs early once their estimated garbage (tombstones plus entries
+  // expected to be overwritten, learned from past compactions) reaches
+  // gc_garbage_ratio of their entries
+  bool gc_compaction = false;
+  double gc_garbage_ratio = 0.3;
+  // While foreground traffic stays below idle_ops_threshold ops/sec, push the
+  // oldest runs of levels at or one run short of their kapacity down into
+  // levels that can absorb them
+  bool idle_compaction = false;
+  double idle_ops_threshold = 1000;
+  // Resize the LOW priority (compaction) pool between autoscale_min_threads
+  // and autoscale_max_threads based on queued tasks, compaction debt and
+  // foreground latency, 0 disables the latency target
+  bool autoscale_threads = false;
+  int autoscale_min_threads = 1;
+  int autoscale_max_threads = 8;
+  double autoscale_latency_us = 0;
+  // Store values of at least min_blob_size bytes in blob files. Compactions
+  // relocate the blobs still alive in the oldest blob_gc_age_cutoff fraction
+  // of blob files, and once the garbage in those files reaches
+  // blob_gc_force_threshold the runs referencing them are rewritten even
+  // when no kapacity is exceeded.
+  bool blob_separation = false;
+  uint64_t min_blob_size = 1024;
+  double blob_gc_age_cutoff = 0.25;
+  double blob_gc_force_threshold = 0.5;
+  // Offload compactions writing to remote_min_output_level or deeper to the
+  // DB's compaction service (a local kap_worker process)
+  bool remote_compaction = false;
+  int remote_min_output_level = 1;
+  // Wake up interval of the idle scheduler and thread autoscaler
+  int maintenance_interval_ms = 1000;
+  // Storage paths sorted by first level, the first one has to start at L0
+  // since flushes always go to the first path. Empty keeps every level in
+  // the DB directory.
+  std::vector<StoragePath> storage_paths;
+  // Key range partitions sorted by lower bound, empty means one policy for
+  // the whole key space
+  std::vector<KeyRangePolicy> partitions;
 
   KapOptions() : kapacities(20, 1) {};
   KapOptions(std::string config_path) { ReadConfig(config_path); }
@@ -43,6 +121,63 @@ class KapOptions {
     this->fixed_file_size = cfg["fixed_file_size"];
     this->num_keys = cfg["num_keys"];
     this->levels = cfg["levels"];
+    this->intra_l0_compaction =
+        cfg.value("intra_l0_compaction", this->intra_l0_compaction);
+    this->intra_l0_min_files =
+        cfg.value("intra_l0_min_files", this->intra_l0_min_files);
+    this->intra_l0_max_size =
+        cfg.value("intra_l0_max_size", this->intra_l0_max_size);
+    this->grandparent_alignment =
+        cfg.value("grandparent_alignment", this->grandparent_alignment);
+    this->max_grandparent_overlap =
+        cfg.value("max_grandparent_overlap", this->max_grandparent_overlap);
+    this->hot_cold_separation =
+        cfg.value("hot_cold_separation", this->hot_cold_separation);
+    this->hot_threshold = cfg.value("hot_threshold", this->hot_threshold);
+    this->hot_kapacity_bonus =
+        cfg.value("hot_kapacity_bonus", this->hot_kapacity_bonus);
+    this->sketch_buckets = cfg.value("sketch_buckets", this->sketch_buckets);
+    this->read_triggered_compaction =
+        cfg.value("read_triggered_compaction", this->read_triggered_compaction);
+    this->read_compaction_threshold =
+        cfg.value("read_compaction_threshold", this->read_compaction_threshold);
+    this->gc_compaction = cfg.value("gc_compaction", this->gc_compaction);
+    this->gc_garbage_ratio =
+        cfg.value("gc_garbage_ratio", this->gc_garbage_ratio);
+    this->idle_compaction = cfg.value("idle_compaction", this->idle_compaction);
+    this->idle_ops_threshold =
+        cfg.value("idle_ops_threshold", this->idle_ops_threshold);
+    this->autoscale_threads =
+        cfg.value("autoscale_threads", this->autoscale_threads);
+    this->autoscale_min_threads =
+        cfg.value("autoscale_min_threads", this->autoscale_min_threads);
+    this->autoscale_max_threads =
+        cfg.value("autoscale_max_threads", this->autoscale_max_threads);
+    this->autoscale_latency_us =
+        cfg.value("autoscale_latency_us", this->autoscale_latency_us);
+    this->blob_separation = cfg.value("blob_separation", this->blob_separation);
+    this->min_blob_size = cfg.value("min_blob_size", this->min_blob_size);
+    this->blob_gc_age_cutoff =
+        cfg.value("blob_gc_age_cutoff", this->blob_gc_age_cutoff);
+    this->blob_gc_force_threshold =
+        cfg.value("blob_gc_force_threshold", this->blob_gc_force_threshold);
+    this->remote_compaction =
+        cfg.value("remote_compaction", this->remote_compaction);
+    this->remote_min_output_level =
+        cfg.value("remote_min_output_level", this->remote_min_output_level);
+    // Options written before the autoscaler shared the thread name the
+    // interval idle_check_interval_ms
+    this->maintenance_interval_ms = cfg.value(
+        "maintenance_interval_ms",
+        cfg.value("idle_check_interval_ms", this->maintenance_interval_ms));
+    if (cfg.contains("partitions")) {
+      this->ParsePartitions(cfg["partitions"]);
+    }
+    this->storage_paths.clear();
+    for (auto& entry : cfg.value("storage_paths", nlohmann::json::array())) {
+      this->AddStoragePath(entry.value("path", ""),
+                           entry.value("first_level", 0));
+    }
 
     return true;
   }
@@ -57,6 +192,44 @@ class KapOptions {
     cfg["fixed_file_size"] = this->fixed_file_size;
     cfg["num_keys"] = this->num_keys;
     cfg["levels"] = this->levels;
+    cfg["intra_l0_compaction"] = this->intra_l0_compaction;
+    cfg["intra_l0_min_files"] = this->intra_l0_min_files;
+    cfg["intra_l0_max_size"] = this->intra_l0_max_size;
+    cfg["grandparent_alignment"] = this->grandparent_alignment;
+    cfg["max_grandparent_overlap"] = this->max_grandparent_overlap;
+    cfg["hot_cold_separation"] = this->hot_cold_separation;
+    cfg["hot_threshold"] = this->hot_threshold;
+    cfg["hot_kapacity_bonus"] = this->hot_kapacity_bonus;
+    cfg["sketch_buckets"] = this->sketch_buckets;
+    cfg["read_triggered_compaction"] = this->read_triggered_compaction;
+    cfg["read_compaction_threshold"] = this->read_compaction_threshold;
+    cfg["gc_compaction"] = this->gc_compaction;
+    cfg["gc_garbage_ratio"] = this->gc_garbage_ratio;
+    cfg["idle_compaction"] = this->idle_compaction;
+    cfg["idle_ops_threshold"] = this->idle_ops_threshold;
+    cfg["autoscale_threads"] = this->autoscale_threads;
+    cfg["autoscale_min_threads"] = this->autoscale_min_threads;
+    cfg["autoscale_max_threads"] = this->autoscale_max_threads;
+    cfg["autoscale_latency_us"] = this->autoscale_latency_us;
+    cfg["blob_separation"] = this->blob_separation;
+    cfg["min_blob_size"] = this->min_blob_size;
+    cfg["blob_gc_age_cutoff"] = this->blob_gc_age_cutoff;
+    cfg["blob_gc_force_threshold"] = this->blob_gc_force_threshold;
+    cfg["remote_compaction"] = this->remote_compaction;
+    cfg["remote_min_output_level"] = this->remote_min_output_level;
+    cfg["maintenance_interval_ms"] = this->maintenance_interval_ms;
+    cfg["partitions"] = nlohmann::json::array();
+    for (auto& partition : this->partitions) {
+      cfg["partitions"].push_back({{"lower_bound", partition.lower_bound},
+                                   {"size_ratio", partition.size_ratio},
+                                   {"kapacities", partition.kapacities}});
+    }
+    cfg["storage_paths"] = nlohmann::json::array();
+    for (auto& storage_path : this->storage_paths) {
+      cfg["storage_paths"].push_back(
+          {{"path", storage_path.path},
+           {"first_level", storage_path.first_level}});
+    }
 
     std::ofstream out_cfg(config_path);
     if (!out_cfg.is_open()) {
@@ -69,6 +242,86 @@ class KapOptions {
 
     return true;
   }
+
+  // Reads a JSON list of {"lower_bound", "size_ratio", "kapacities"} objects
+  bool ReadPartitions(std::string partition_path) {
+    nlohmann::json cfg;
+    std::ifstream read_cfg(partition_path);
+    if (!read_cfg.is_open()) {
+      spdlog::error("Unable to read partitions: {}", partition_path);
+      return false;
+    }
+    read_cfg >> cfg;
+    this->ParsePartitions(cfg);
+
+    return true;
+  }
+
+  void ParsePartitions(const nlohmann::json& cfg) {
+    this->partitions.clear();
+    for (auto& entry : cfg) {
+      KeyRangePolicy partition;
+      partition.lower_bound = entry.value("lower_bound", "");
+      partition.size_ratio = entry.value("size_ratio", this->size_ratio);
+      partition.kapacities =
+          entry.value("kapacities", std::vector<int>(20, 1));
+      this->partitions.push_back(partition);
+    }
+    std::sort(this->partitions.begin(), this->partitions.end(),
+              [](auto& a, auto& b) { return a.lower_bound < b.lower_bound; });
+  }
+
+  void AddStoragePath(const std::string& path, int first_level) {
+    this->storage_paths.push_back({path, first_level});
+    std::stable_sort(
+        this->storage_paths.begin(), this->storage_paths.end(),
+        [](auto& a, auto& b) { return a.first_level < b.first_level; });
+  }
+
+  // Index of the storage path holding the level (the output_path_id of
+  // compactions into it), -1 when no storage path is configured
+  int StoragePathOf(int level) const {
+    int path_id = -1;
+    for (size_t idx = 0; idx < this->storage_paths.size(); idx++) {
+      if (this->storage_paths[idx].first_level <= level) {
+        path_id = static_cast<int>(idx);
+      }
+    }
+    return path_id;
+  }
+
+  size_t NumPartitions() const {
+    return std::max<size_t>(this->partitions.size(), 1);
+  }
+
+  // Index of the partition holding the key, keys below the first lower bound
+  // belong to the first partition
+  size_t PartitionOf(const std::string& key) const {
+    auto it = std::upper_bound(
+        this->partitions.begin(), this->partitions.end(), key,
+        [](auto& k, auto& partition) { return k < partition.lower_bound; });
+    if (it == this->partitions.begin()) {
+      return 0;
+    }
+    return std::distance(this->partitions.begin(), it) - 1;
+  }
+
+  int Kapacity(size_t partition, int level) const {
+    auto& level_kapacities = (level == 0 || this->partitions.empty())
+                                 ? this->kapacities
+                                 : this->partitions[partition].kapacities;
+    if (static_cast<size_t>(level) < level_kapacities.size()) {
+      return level_kapacities[level];
+    }
+    return 1;
+  }
+
+  int SizeRatio(size_t partition) const {
+    if (this->partitions.empty()) {
+      return this->size_ratio;
+    }
+    return this->partitions[partition].size_ratio;
+  }
 };
 
 }  // namespace kaplsm
@@ -0,0 +1,132 @@
+#include "kap_partitioner.hpp"
+
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+
+using ROCKSDB_NAMESPACE::kNotRequired;
+using ROCKSDB_NAMESPACE::kRequired;
+
+using namespace kaplsm;
+
+KapPartitioner::KapPartitioner(std::vector<std::string> boundaries,
+                               const Slice& smallest_key,
+                               uint64_t min_file_size, int max_overlap,
+                               std::vector<std::string> partition_bounds,
+                               std::shared_ptr<const AccessSketch> sketch,
+                               std::vector<bool> hot_buckets)
+    : boundaries_(std::move(boundaries)),
+      min_file_size_(min_file_size),
+      max_overlap_(max_overlap),
+      partition_bounds_(std::move(partition_bounds)),
+      sketch_(std::move(sketch)),
+      hot_buckets_(std::move(hot_buckets)) {
+  if (!hot_buckets_.empty()) {
+    current_hot_ = hot_buckets_[sketch_->Bucket(smallest_key)];
+  }
+  // Boundaries at or below the first key of the compaction are never crossed
+  while (next_boundary_ < boundaries_.size() &&
+         smallest_key.compare(boundaries_[next_boundary_]) >= 0) {
+    next_boundary_++;
+  }
+  while (next_partition_ < partition_bounds_.size() &&
+         smallest_key.compare(partition_bounds_[next_partition_]) >= 0) {
+    next_partition_++;
+  }
+}
+
+PartitionerResult KapPartitioner::ShouldPartition(
+    const PartitionerRequest& request) {
+  // RocksDB started a new output on its own (file size limit), so the overlap
+  // count starts over
+  if (request.current_output_file_size < last_file_size_) {
+    crossed_ = 0;
+    heat_pending_ = false;
+  }
+  last_file_size_ = request.current_output_file_size;
+
+  int crossed_now = 0;
+  while (next_boundary_ < boundaries_.size() &&
+         request.current_user_key->compare(boundaries_[next_boundary_]) >= 0) {
+    next_boundary_++;
+    crossed_now++;
+  }
+  crossed_ += crossed_now;
+
+  if (!hot_buckets_.empty()) {
+    bool hot = hot_buckets_[sketch_->Bucket(*request.current_user_key)];
+    // A transition within the first min_file_size_ bytes of an output is
+    // kept until the file may be cut
+    heat_pending_ = heat_pending_ || hot != current_hot_;
+    current_hot_ = hot;
+  }
+
+  bool partition_changed = false;
+  while (next_partition_ < partition_bounds_.size() &&
+         request.current_user_key->compare(
+             partition_bounds_[next_partition_]) >= 0) {
+    next_partition_++;
+    partition_changed = true;
+  }
+  if (partition_changed) {
+    crossed_ = 0;
+    last_file_size_ = 0;
+    heat_pending_ = false;
+    return kRequired;
+  }
+
+  if (request.current_output_file_size < min_file_size_) {
+    return kNotRequired;
+  }
+  if (heat_pending_ || (crossed_now > 0 && crossed_ >= max_overlap_)) {
+    crossed_ = 0;
+    last_file_size_ = 0;
+    heat_pending_ = false;
+    return kRequired;
+  }
+
+  return kNotRequired;
+}
+
+bool KapPartitioner::CanDoTrivialMove(const Slice& /*smallest_user_key*/,
+                                      const Slice& /*largest_user_key*/) {
+  return true;
+}
+
+std::unique_ptr<SstPartitioner> KapPartitionerFactory::CreatePartitioner(
+    const SstPartitioner::Context& context) const {
+  std::vector<std::string> boundaries;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t grandparent_level = context.output_level + 1;
+    if (grandparent_level < level_boundaries_.size()) {
+      boundaries = level_boundaries_[grandparent_level];
+    }
+  }
+  // Hot buckets are fixed for the lifetime of one compaction
+  std::vector<bool> hot_buckets;
+  if (sketch_ != nullptr && sketch_->HasKeyBounds()) {
+    hot_buckets = sketch_->HotBuckets(hot_threshold_);
+  }
+  spdlog::trace("Partitioner for L{} with {} grandparent boundaries",
+                context.output_level, boundaries.size());
+
+  return std::make_unique<KapPartitioner>(
+      std::move(boundaries), context.smallest_user_key, min_file_size_,
+      max_overlap_, partition_bounds_, sketch_, std::move(hot_buckets));
+}
+
+void KapPartitionerFactory::SetLevelBoundaries(
+    const rocksdb::LevelMetaData& level) {
+  std::vector<std::string> boundaries;
+  for (auto& file : level.files) {
+    boundaries.push_back(file.smallestkey);
+  }
+  std::sort(boundaries.begin(), boundaries.end());
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (static_cast<size_t>(level.level) >= level_boundaries_.size()) {
+    level_boundaries_.resize(level.level + 1);
+  }
+  level_boundaries_[level.level] = std::move(boundaries);
+}
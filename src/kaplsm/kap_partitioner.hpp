@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "access_sketch.hpp"
+#include "rocksdb/metadata.h"
+#include "rocksdb/slice.h"
+#include "rocksdb/sst_partitioner.h"
+
+using ROCKSDB_NAMESPACE::PartitionerRequest;
+using ROCKSDB_NAMESPACE::PartitionerResult;
+using ROCKSDB_NAMESPACE::Slice;
+using ROCKSDB_NAMESPACE::SstPartitioner;
+using ROCKSDB_NAMESPACE::SstPartitionerFactory;
+
+namespace kaplsm {
+
+// Cuts compaction outputs at the file boundaries of the level below the output
+// level (the grandparents of the compaction). Once an output file has spanned
+// max_overlap grandparent boundaries it is closed at the next boundary, so the
+// next compaction out of the output level reads as few grandparent bytes as
+// possible.
+//
+// Outputs are always cut at the lower bounds of the key range partitions so
+// every file belongs to exactly one partition.
+//
+// With an access sketch attached, outputs are also cut wherever the key space
+// switches between hot and cold buckets so hot and cold data land in separate
+// files that the compactor can place independently. A switch within the first
+// min_file_size bytes of an output cuts the file at the first key past that
+// size.
+class KapPartitioner : public SstPartitioner {
+ public:
+  KapPartitioner(std::vector<std::string> boundaries, const Slice& smallest_key,
+                 uint64_t min_file_size, int max_overlap,
+                 std::vector<std::string> partition_bounds = {},
+                 std::shared_ptr<const AccessSketch> sketch = nullptr,
+                 std::vector<bool> hot_buckets = {});
+
+  const char* Name() const override { return "KapPartitioner"; }
+
+  PartitionerResult ShouldPartition(const PartitionerRequest& request) override;
+
+  bool CanDoTrivialMove(const Slice& smallest_user_key,
+                        const Slice& largest_user_key) override;
+
+ private:
+  std::vector<std::string> boundaries_;
+  size_t next_boundary_ = 0;
+  uint64_t min_file_size_;
+  int max_overlap_;
+  int crossed_ = 0;
+  uint64_t last_file_size_ = 0;
+
+  std::vector<std::string> partition_bounds_;
+  size_t next_partition_ = 0;
+
+  std::shared_ptr<const AccessSketch> sketch_;
+  std::vector<bool> hot_buckets_;
+  bool current_hot_ = false;
+  bool heat_pending_ = false;
+};
+
+class KapPartitionerFactory : public SstPartitionerFactory {
+ public:
+  KapPartitionerFactory(uint64_t min_file_size, int max_overlap)
+      : min_file_size_(min_file_size), max_overlap_(max_overlap) {}
+
+  static const char* kClassName() { return "KapPartitionerFactory"; }
+  const char* Name() const override { return kClassName(); }
+
+  std::unique_ptr<SstPartitioner> CreatePartitioner(
+      const SstPartitioner::Context& context) const override;
+
+  // Records the sorted start keys of every file in the level. Called by the
+  // compactor whenever it picks a compaction that outputs above this level.
+  void SetLevelBoundaries(const rocksdb::LevelMetaData& level);
+
+  // Lower bounds of every key range partition but the first
+  void SetPartitionBounds(std::vector<std::string> partition_bounds) {
+    partition_bounds_ = std::move(partition_bounds);
+  }
+
+  // Splits outputs at hot/cold transitions of the sketch, a bucket is hot when
+  // its access count is at least hot_threshold times the mean
+  void SetAccessSketch(std::shared_ptr<const AccessSketch> sketch,
+                       double hot_threshold) {
+    sketch_ = std::move(sketch);
+    hot_threshold_ = hot_threshold;
+  }
+
+ private:
+  uint64_t min_file_size_;
+  int max_overlap_;
+  std::vector<std::string> partition_bounds_;
+  std::shared_ptr<const AccessSketch> sketch_;
+  double hot_threshold_ = 0;
+  mutable std::mutex mutex_;
+  std::vector<std::vector<std::string>> level_boundaries_;
+};
+
+}  // namespace kaplsm
@@ -0,0 +1,302 @@
+#include "kap_scheduler.hpp"
+
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include "kap_compactor.hpp"
+
+using namespace kaplsm;
+
+void KapScheduler::Register(KapCompactor* compactor) {
+  std::lock_guard<std::mutex> lock(this->pass_mutex_);
+  this->compactors_.insert(compactor);
+}
+
+void KapScheduler::Unregister(KapCompactor* compactor) {
+  {
+    std::lock_guard<std::mutex> lock(this->pass_mutex_);
+    this->compactors_.erase(compactor);
+  }
+  for (auto task : this->Drain(compactor)) {
+    delete task;
+  }
+  std::lock_guard<std::mutex> lock(this->dispatch_mutex_);
+  auto it = std::find_if(this->queues_.begin(), this->queues_.end(),
+                         [&](auto& queue) { return queue.first == compactor; });
+  if (it != this->queues_.end()) {
+    this->queues_.erase(it);
+    this->next_queue_ = 0;
+  }
+}
+
+void KapScheduler::Start() {
+  if (this->thread_.joinable()) {
+    return;
+  }
+  this->stop_ = false;
+  this->running_ = true;
+  this->thread_ = std::thread([this]() {
+    while (true) {
+      {
+        // Producers notify without taking the lock, the timeout bounds the
+        // delay of a missed wake up
+        std::unique_lock<std::mutex> lock(this->mutex_);
+        this->cv_.wait_for(lock, std::chrono::milliseconds(10), [this]() {
+          return this->stop_.load() || !this->events_.Empty();
+        });
+      }
+      if (this->stop_.load()) {
+        break;
+      }
+      auto events = this->events_.PopAll();
+      if (events.empty()) {
+        continue;
+      }
+
+      // Group the events by compactor, in the order compactors first showed
+      // up, so each runs at most one pass per event kind
+      std::vector<std::pair<KapCompactor*, std::vector<CompactorEvent>>>
+          batches;
+      for (auto& event : events) {
+        auto it = std::find_if(
+            batches.begin(), batches.end(),
+            [&](auto& batch) { return batch.first == event.compactor; });
+        if (it == batches.end()) {
+          batches.push_back({event.compactor, {event}});
+        } else {
+          it->second.push_back(event);
+        }
+      }
+      std::lock_guard<std::mutex> lock(this->pass_mutex_);
+      for (auto& [compactor, batch] : batches) {
+        if (this->compactors_.count(compactor) > 0) {
+          compactor->HandleEvents(batch);
+        }
+      }
+    }
+  });
+}
+
+void KapScheduler::Stop() {
+  if (!this->thread_.joinable()) {
+    return;
+  }
+  this->stop_ = true;
+  this->cv_.notify_all();
+  this->thread_.join();
+  this->running_ = false;
+  this->events_.PopAll();
+}
+
+void KapScheduler::PushEvent(const CompactorEvent& event) {
+  this->events_.Push(event);
+  this->cv_.notify_one();
+}
+
+void KapScheduler::Submit(KapCompactor* compactor, CompactionTask* task) {
+  {
+    std::lock_guard<std::mutex> lock(this->dispatch_mutex_);
+    auto it = std::find_if(
+        this->queues_.begin(), this->queues_.end(),
+        [&](auto& queue) { return queue.first == compactor; });
+    if (it == this->queues_.end()) {
+      this->queues_.push_back({compactor, {task}});
+    } else {
+      // Behind every queued task of the same or a higher priority
+      auto& queue = it->second;
+      auto pos = std::find_if(queue.begin(), queue.end(), [&](auto queued) {
+        return TaskPriority(queued->reason) > TaskPriority(task->reason);
+      });
+      queue.insert(pos, task);
+    }
+  }
+  this->Dispatch();
+}
+
+void KapScheduler::Dispatch() {
+  std::vector<std::pair<KapCompactor*, CompactionTask*>> ready;
+  {
+    std::lock_guard<std::mutex> lock(this->dispatch_mutex_);
+    int budget = std::max(
+        1, this->env_->GetBackgroundThreads(rocksdb::Env::Priority::LOW));
+    while (this->in_flight_ < budget) {
+      size_t num_queues = this->queues_.size();
+      size_t idx = 0;
+      while (idx < num_queues &&
+             this->queues_[(this->next_queue_ + idx) % num_queues]
+                 .second.empty()) {
+        idx++;
+      }
+      if (idx == num_queues) {
+        break;
+      }
+      auto& [compactor, queue] =
+          this->queues_[(this->next_queue_ + idx) % num_queues];
+      ready.emplace_back(compactor, queue.front());
+      queue.pop_front();
+      this->next_queue_ = (this->next_queue_ + idx + 1) % num_queues;
+      this->in_flight_++;
+    }
+  }
+
+  // Tagged with the compactor so its queued tasks can be dropped on cancel
+  for (auto& [compactor, task] : ready) {
+    this->env_->Schedule(&KapCompactor::CompactFiles, task,
+                         rocksdb::Env::Priority::LOW, compactor,
+                         &KapCompactor::UnscheduleCompaction);
+  }
+}
+
+void KapScheduler::TaskDone() {
+  {
+    std::lock_guard<std::mutex> lock(this->dispatch_mutex_);
+    this->in_flight_--;
+  }
+  this->Dispatch();
+}
+
+std::vector<CompactionTask*> KapScheduler::Drain(KapCompactor* compactor) {
+  std::lock_guard<std::mutex> lock(this->dispatch_mutex_);
+  std::vector<CompactionTask*> tasks;
+  for (auto& [owner, queue] : this->queues_) {
+    if (owner == compactor) {
+      tasks.assign(queue.begin(), queue.end());
+      queue.clear();
+    }
+  }
+  return tasks;
+}
+
+size_t KapScheduler::QueuedTasks() {
+  std::lock_guard<std::mutex> lock(this->dispatch_mutex_);
+  size_t queued = 0;
+  for (auto& [compactor, queue] : this->queues_) {
+    queued += queue.size();
+  }
+  return queued;
+}
+
+bool KapScheduler::AllCanceled() {
+  std::lock_guard<std::mutex> lock(this->pass_mutex_);
+  return std::all_of(
+      this->compactors_.begin(), this->compactors_.end(),
+      [](auto compactor) { return compactor->CompactionsCanceled(); });
+}
+
+void KapScheduler::StartMaintenance(
+    DB* db, const KapOptions& kap_options,
+    std::shared_ptr<rocksdb::Statistics> statistics) {
+  if (this->maintenance_thread_.joinable()) {
+    return;
+  }
+  this->maintenance_options_ = kap_options;
+  this->statistics_ = statistics;
+  this->maintenance_stop_ = false;
+  this->maintenance_thread_ = std::thread([this, db]() {
+    auto interval = std::chrono::milliseconds(
+        this->maintenance_options_.maintenance_interval_ms);
+    auto foreground_ops = [this]() {
+      uint64_t ops = 0;
+      for (auto compactor : this->compactors_) {
+        ops += compactor->GetForegroundOps();
+      }
+      return ops;
+    };
+    uint64_t last_ops = 0;
+    {
+      std::lock_guard<std::mutex> lock(this->pass_mutex_);
+      last_ops = foreground_ops();
+    }
+    auto last_check = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(this->maintenance_mutex_);
+    while (!this->maintenance_cv_.wait_for(
+        lock, interval, [this]() { return this->maintenance_stop_; })) {
+      // Compactors stay registered for the whole pass
+      std::lock_guard<std::mutex> pass_lock(this->pass_mutex_);
+      auto now = std::chrono::steady_clock::now();
+      uint64_t ops = foreground_ops();
+      double seconds = std::chrono::duration<double>(now - last_check).count();
+      // Compactors unregistered since the last check take their counts along
+      double ops_per_sec = ops >= last_ops ? (ops - last_ops) / seconds : 0;
+      last_ops = ops;
+      last_check = now;
+      if (this->maintenance_options_.autoscale_threads) {
+        this->AutoscaleThreads(db);
+      }
+      for (auto compactor : this->compactors_) {
+        compactor->ScheduleIdleCompaction(db, ops_per_sec);
+      }
+    }
+  });
+}
+
+void KapScheduler::StopMaintenance() {
+  if (!this->maintenance_thread_.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(this->maintenance_mutex_);
+    this->maintenance_stop_ = true;
+  }
+  this->maintenance_cv_.notify_all();
+  this->maintenance_thread_.join();
+}
+
+// Called with pass_mutex_ held
+void KapScheduler::AutoscaleThreads(DB* db) {
+  auto& opt = this->maintenance_options_;
+  int threads = this->env_->GetBackgroundThreads(rocksdb::Env::Priority::LOW);
+  unsigned int queued =
+      this->env_->GetThreadPoolQueueLen(rocksdb::Env::Priority::LOW) +
+      this->QueuedTasks();
+  uint64_t debt = 0;
+  bool l0_pressure = false;
+  for (auto compactor : this->compactors_) {
+    debt += compactor->EstimateCompactionDebt(db);
+    l0_pressure = l0_pressure || compactor->L0OverKapacity(db);
+  }
+
+  // Mean Get/Put latency since the last check, 0 without statistics
+  double latency_us = 0;
+  if (this->statistics_ != nullptr) {
+    rocksdb::HistogramData get_hist, write_hist;
+    this->statistics_->histogramData(rocksdb::DB_GET, &get_hist);
+    this->statistics_->histogramData(rocksdb::DB_WRITE, &write_hist);
+    uint64_t count = get_hist.count + write_hist.count;
+    uint64_t sum = get_hist.sum + write_hist.sum;
+    // Counters go backwards when the statistics are reset
+    if (count > this->last_fg_count_ && sum >= this->last_fg_sum_) {
+      latency_us = static_cast<double>(sum - this->last_fg_sum_) /
+                   (count - this->last_fg_count_);
+    }
+    this->last_fg_count_ = count;
+    this->last_fg_sum_ = sum;
+  }
+
+  bool backlog = queued > 0 && debt > 0;
+  bool readers_hurt = opt.autoscale_latency_us > 0 &&
+                      latency_us > opt.autoscale_latency_us;
+
+  // Add a thread while work is queued up, unless the extra thread would slow
+  // down foreground reads that are already over their latency target. L0
+  // pressure always wins since it ends in a write stall.
+  int target = threads;
+  if (backlog && (!readers_hurt || l0_pressure)) {
+    target++;
+  } else if (!backlog || readers_hurt) {
+    target--;
+  }
+  target = std::clamp(target, opt.autoscale_min_threads,
+                      opt.autoscale_max_threads);
+  if (target != threads) {
+    spdlog::debug(
+        "Resizing compaction pool {} -> {} (queued {}, debt {} B, latency "
+        "{:.1f} us)",
+        threads, target, queued, debt, latency_us);
+    this->env_->SetBackgroundThreads(target, rocksdb::Env::Priority::LOW);
+    this->thread_resizes_++;
+    this->Dispatch();
+  }
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "event_queue.hpp"
+#include "kap_options.hpp"
+#include "rocksdb/db.h"
+#include "rocksdb/env.h"
+#include "rocksdb/statistics.h"
+
+using ROCKSDB_NAMESPACE::DB;
+
+namespace kaplsm {
+
+class KapCompactor;
+struct CompactionTask;
+
+// Pushed by the listener callbacks and consumed by the scheduler thread
+struct CompactorEvent {
+  enum class Kind { kFlush, kCompaction };
+  Kind kind;
+  DB* db;
+  bool triggered_writes_stop = false;
+  KapCompactor* compactor = nullptr;
+};
+
+// Shared by the compactors of every column family of a DB. A single thread
+// consumes the listener events of all compactors and runs their pick passes,
+// and picked tasks go through a per compactor queue before reaching the LOW
+// priority pool. Each queue is ordered by TaskPriority, and queues are served
+// round robin with at most one task per pool thread handed to the pool, so a
+// column family with a deep backlog cannot starve the others. The pool being
+// the DB's, the maintenance thread sizing it also lives here.
+class KapScheduler {
+ public:
+  explicit KapScheduler(rocksdb::Env* env) : env_(env) {}
+  ~KapScheduler() {
+    StopMaintenance();
+    Stop();
+  }
+
+  // Compactors must be registered to receive events and submit tasks, and
+  // unregistered before they are destroyed
+  void Register(KapCompactor* compactor);
+  void Unregister(KapCompactor* compactor);
+
+  // Starts the thread consuming listener events. Bursts of events are
+  // coalesced by each compactor into one pick pass per event kind.
+  void Start();
+  void Stop();
+  bool Running() { return running_.load(); }
+
+  void PushEvent(const CompactorEvent& event);
+
+  // Queues a task behind the compactor's tasks of the same or a higher
+  // priority, it reaches the pool once a thread is free and every compactor
+  // ahead in the round had its turn
+  void Submit(KapCompactor* compactor, CompactionTask* task);
+
+  // Hands queued tasks to the pool while it has free threads, called after a
+  // task ends and when the pool is resized
+  void Dispatch();
+
+  // Called once a task handed to the pool has run or was unscheduled
+  void TaskDone();
+
+  // Removes and returns the tasks of the compactor that did not reach the
+  // pool yet
+  std::vector<CompactionTask*> Drain(KapCompactor* compactor);
+
+  // Tasks waiting for a pool thread across all compactors
+  size_t QueuedTasks();
+
+  // True once every registered compactor canceled its compactions
+  bool AllCanceled();
+
+  // Starts a thread that wakes every maintenance_interval_ms to resize the
+  // pool (autoscale_threads) and to offer each compactor an idle compaction
+  // (its own idle_compaction). kap_options are the default column family's,
+  // statistics the DB's, foreground traffic is summed over all compactors.
+  void StartMaintenance(DB* db, const KapOptions& kap_options,
+                        std::shared_ptr<rocksdb::Statistics> statistics);
+  void StopMaintenance();
+
+  // Grows the LOW priority pool by one thread while compactions are queued
+  // and some column family has compaction debt, and shrinks it once the
+  // backlog is gone or foreground latency is over autoscale_latency_us
+  void AutoscaleThreads(DB* db);
+
+  int GetThreadResizeCount() { return thread_resizes_.load(); }
+
+ private:
+  rocksdb::Env* env_;
+
+  EventQueue<CompactorEvent> events_;
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::atomic<bool> stop_{false};
+  std::atomic<bool> running_{false};
+  // Held while a batch of events is handled so a compactor is never
+  // unregistered in the middle of its pick pass
+  std::mutex pass_mutex_;
+  std::set<KapCompactor*> compactors_;
+
+  std::mutex dispatch_mutex_;
+  std::vector<std::pair<KapCompactor*, std::deque<CompactionTask*>>> queues_;
+  size_t next_queue_ = 0;
+  int in_flight_ = 0;
+
+  std::thread maintenance_thread_;
+  std::mutex maintenance_mutex_;
+  std::condition_variable maintenance_cv_;
+  bool maintenance_stop_ = false;
+  KapOptions maintenance_options_;
+  std::shared_ptr<rocksdb::Statistics> statistics_;
+  uint64_t last_fg_count_ = 0;
+  uint64_t last_fg_sum_ = 0;
+  std::atomic<int> thread_resizes_{0};
+};
+
+}  // namespace kaplsm
@@ -0,0 +1,59 @@
+#include "histogram.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+// One exact range plus one linear range per remaining power of two
+constexpr size_t kNumBuckets =
+    (64 - LatencyHistogram::kSubBucketBits + 1) * LatencyHistogram::kSubBuckets;
+}  // namespace
+
+LatencyHistogram::LatencyHistogram() : buckets_(kNumBuckets, 0) {}
+
+size_t LatencyHistogram::BucketOf(uint64_t value) {
+  if (value < kSubBuckets) {
+    return value;
+  }
+  int msb = 63 - __builtin_clzll(value);
+  int shift = msb - kSubBucketBits;
+  uint64_t sub_bucket = (value >> shift) - kSubBuckets;
+
+  return (shift + 1) * kSubBuckets + sub_bucket;
+}
+
+uint64_t LatencyHistogram::BucketUpperBound(size_t bucket) {
+  if (bucket < kSubBuckets) {
+    return bucket;
+  }
+  int shift = bucket / kSubBuckets - 1;
+  uint64_t sub_bucket = bucket % kSubBuckets + kSubBuckets;
+
+  return ((sub_bucket + 1) << shift) - 1;
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram& other) {
+  for (size_t idx = 0; idx < kNumBuckets; idx++) {
+    this->buckets_[idx] += other.buckets_[idx];
+  }
+  this->count_ += other.count_;
+  this->max_ = std::max(this->max_, other.max_);
+}
+
+uint64_t LatencyHistogram::Percentile(double percentile) const {
+  if (this->count_ == 0) {
+    return 0;
+  }
+  uint64_t rank = static_cast<uint64_t>(
+      std::ceil(percentile / 100.0 * static_cast<double>(this->count_)));
+  rank = std::clamp<uint64_t>(rank, 1, this->count_);
+  uint64_t seen = 0;
+  for (size_t idx = 0; idx < kNumBuckets; idx++) {
+    seen += this->buckets_[idx];
+    if (seen >= rank) {
+      return std::min(BucketUpperBound(idx), this->max_);
+    }
+  }
+
+  return this->max_;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Log-linear latency histogram in the spirit of HdrHistogram. Values below
+// kSubBuckets are counted exactly, above that every power of two is split
+// into kSubBuckets linear buckets, bounding the error of a reported
+// percentile to about 1 / kSubBuckets. Not thread safe, each client thread
+// records into its own histogram and the histograms are merged at the end.
+class LatencyHistogram {
+ public:
+  static constexpr int kSubBucketBits = 5;
+  static constexpr uint64_t kSubBuckets = 1ULL << kSubBucketBits;
+
+  LatencyHistogram();
+
+  void Record(uint64_t value) {
+    this->buckets_[BucketOf(value)]++;
+    this->count_++;
+    if (value > this->max_) {
+      this->max_ = value;
+    }
+  }
+
+  void Merge(const LatencyHistogram& other);
+
+  // Upper bound of the bucket holding the given percentile (0 to 100),
+  // clamped to the largest recorded value
+  uint64_t Percentile(double percentile) const;
+
+  uint64_t Count() const { return count_; }
+  uint64_t Max() const { return max_; }
+
+ private:
+  static size_t BucketOf(uint64_t value);
+  static uint64_t BucketUpperBound(size_t bucket);
+
+  std::vector<uint64_t> buckets_;
+  uint64_t count_ = 0;
+  uint64_t max_ = 0;
+};
@@ -1,6 +1,9 @@
 #include "keygen.hpp"
 
+#include <algorithm>
+#include <numeric>
 #include <random>
+#include <utility>
 
 #include "zipf.hpp"
 
@@ -10,8 +13,62 @@ Uniform::Uniform(int max) {
 
 int Uniform::gen(std::mt19937 &engine) { return this->dist(engine); }
 
-Zipf::Zipf(int max) {
-  this->dist = opencog::zipf_distribution<int, double>(max);
+Zipf::Zipf(int max, double s) {
+  this->dist = opencog::zipf_distribution<int, double>(max, s);
 }
 
 int Zipf::gen(std::mt19937 &engine) { return this->dist(engine); }
+
+Hotspot::Hotspot(int max, double hot_set_fraction, double hot_op_fraction)
+    : hot_op_fraction(hot_op_fraction), op_dist(0.0, 1.0) {
+  int hot_max = std::clamp(
+      static_cast<int>(hot_set_fraction * (static_cast<double>(max) + 1)) - 1,
+      0, max);
+  this->hot_dist = std::uniform_int_distribution<int>(0, hot_max);
+  // An empty cold range sends every draw to the hot set
+  this->cold_dist = std::uniform_int_distribution<int>(
+      std::min(hot_max + 1, max), max);
+  if (hot_max == max) {
+    this->hot_op_fraction = 1.0;
+  }
+}
+
+int Hotspot::gen(std::mt19937 &engine) {
+  if (this->op_dist(engine) < this->hot_op_fraction) {
+    return this->hot_dist(engine);
+  }
+  return this->cold_dist(engine);
+}
+
+Scrambled::Scrambled(std::unique_ptr<Distribution> ranks, int max)
+    : ranks(std::move(ranks)), range(static_cast<uint64_t>(max) + 1) {
+  this->stride =
+      std::max<uint64_t>(1, static_cast<uint64_t>(this->range * 0.6180339887));
+  while (std::gcd(this->stride, this->range) != 1) {
+    this->stride++;
+  }
+}
+
+int Scrambled::gen(std::mt19937 &engine) {
+  uint64_t rank = this->ranks->gen(engine) % this->range;
+
+  return static_cast<int>(rank * this->stride % this->range);
+}
+
+std::unique_ptr<Distribution> new_key_distribution(const std::string &name,
+                                                   int max,
+                                                   const SkewOptions &skew) {
+  if (name == "uniform") {
+    return std::make_unique<Uniform>(max);
+  } else if (name == "zipf") {
+    return std::make_unique<Scrambled>(
+        std::make_unique<Zipf>(max + 1, skew.zipf_s), max);
+  } else if (name == "hotspot") {
+    return std::make_unique<Scrambled>(
+        std::make_unique<Hotspot>(max, skew.hot_set_fraction,
+                                  skew.hot_op_fraction),
+        max);
+  }
+
+  return nullptr;
+}
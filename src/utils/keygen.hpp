@@ -3,8 +3,11 @@
 #include <spdlog/spdlog.h>
 
 #include <cassert>
+#include <cstdint>
 #include <ctime>
+#include <memory>
 #include <random>
+#include <string>
 
 #include "zipf.hpp"
 
@@ -26,12 +29,58 @@ class Uniform : public Distribution {
   std::uniform_int_distribution<int> dist;
 };
 
+// Ranks in [1, max] following 1/rank^s, rank 1 being the most popular
 class Zipf : public Distribution {
  public:
-  Zipf(int max);
+  Zipf(int max, double s = 1.0);
   ~Zipf() {}
   int gen(std::mt19937& engine);
 
  private:
   opencog::zipf_distribution<int, double> dist;
 };
+
+// Values in [0, max], hot_op_fraction of them drawn uniformly from the
+// first hot_set_fraction of the range and the rest from the remainder
+class Hotspot : public Distribution {
+ public:
+  Hotspot(int max, double hot_set_fraction, double hot_op_fraction);
+  ~Hotspot() {}
+  int gen(std::mt19937& engine);
+
+ private:
+  double hot_op_fraction;
+  std::uniform_real_distribution<double> op_dist;
+  std::uniform_int_distribution<int> hot_dist;
+  std::uniform_int_distribution<int> cold_dist;
+};
+
+// Spreads the ranks drawn by another distribution over [0, max], so popular
+// ranks do not cluster into one key range. Unlike the FNV hash of YCSB's
+// scrambled zipfian this is a permutation (rank * stride mod range, with
+// the stride close to range / golden ratio and coprime to it), so distinct
+// ranks never collide and neighbouring ranks land far apart.
+class Scrambled : public Distribution {
+ public:
+  Scrambled(std::unique_ptr<Distribution> ranks, int max);
+  ~Scrambled() {}
+  int gen(std::mt19937& engine);
+
+ private:
+  std::unique_ptr<Distribution> ranks;
+  uint64_t range;
+  uint64_t stride;
+};
+
+struct SkewOptions {
+  double zipf_s = 0.99;
+  double hot_set_fraction = 0.2;
+  double hot_op_fraction = 0.8;
+};
+
+// Key indices in [0, max] for "uniform", "zipf" or "hotspot", with the hot
+// ranks of the skewed ones scrambled across the range. Returns nullptr for
+// any other name.
+std::unique_ptr<Distribution> new_key_distribution(const std::string& name,
+                                                   int max,
+                                                   const SkewOptions& skew);
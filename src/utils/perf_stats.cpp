@@ -0,0 +1,108 @@
+#include "perf_stats.hpp"
+
+#include <spdlog/spdlog.h>
+
+#include "rocksdb/iostats_context.h"
+#include "rocksdb/perf_context.h"
+
+void PerfStats::Enable(rocksdb::PerfLevel level) {
+  rocksdb::SetPerfLevel(level);
+  if (level >= rocksdb::PerfLevel::kEnableCount) {
+    rocksdb::get_perf_context()->EnablePerLevelPerfContext();
+    PerfStats::Reset();
+  } else {
+    // Also disables the per level counters and frees them
+    rocksdb::get_perf_context()->ClearPerLevelPerfContext();
+  }
+}
+
+// PerfContext::Reset zeroes the per level counters in place, while
+// ClearPerLevelPerfContext would also turn them off until enabled again
+void PerfStats::Reset() {
+  rocksdb::get_perf_context()->Reset();
+  rocksdb::get_iostats_context()->Reset();
+}
+
+PerfStats PerfStats::Capture() {
+  PerfStats stats;
+  if (rocksdb::GetPerfLevel() < rocksdb::PerfLevel::kEnableCount) {
+    return stats;
+  }
+
+  auto perf = rocksdb::get_perf_context();
+  stats.block_reads = perf->block_read_count;
+  stats.block_read_bytes = perf->block_read_byte;
+  stats.block_read_nanos = perf->block_read_time;
+  stats.bloom_checks = perf->bloom_sst_hit_count + perf->bloom_sst_miss_count;
+  stats.bloom_hits = perf->bloom_sst_hit_count;
+  stats.get_from_table_nanos = perf->get_from_output_files_time;
+  stats.seeks = perf->iter_seek_count;
+  stats.nexts = perf->iter_next_count;
+  stats.internal_keys_skipped = perf->internal_key_skipped_count;
+  auto iostats = rocksdb::get_iostats_context();
+  stats.bytes_read = iostats->bytes_read;
+  stats.read_nanos = iostats->read_nanos;
+  if (perf->level_to_perf_context != nullptr) {
+    for (auto& [level, by_level] : *perf->level_to_perf_context) {
+      // Levels touched before the last reset keep an entry of zeroes
+      if (by_level.bloom_filter_useful == 0 &&
+          by_level.bloom_filter_full_positive == 0 &&
+          by_level.get_from_table_nanos == 0) {
+        continue;
+      }
+      auto& level_stats = stats.levels[level];
+      level_stats.bloom_useful = by_level.bloom_filter_useful;
+      level_stats.bloom_positive = by_level.bloom_filter_full_positive;
+      level_stats.bloom_true_positive =
+          by_level.bloom_filter_full_true_positive;
+      level_stats.get_from_table_nanos = by_level.get_from_table_nanos;
+    }
+  }
+
+  return stats;
+}
+
+void PerfStats::Merge(const PerfStats& other) {
+  this->block_reads += other.block_reads;
+  this->block_read_bytes += other.block_read_bytes;
+  this->block_read_nanos += other.block_read_nanos;
+  this->bloom_checks += other.bloom_checks;
+  this->bloom_hits += other.bloom_hits;
+  this->get_from_table_nanos += other.get_from_table_nanos;
+  this->seeks += other.seeks;
+  this->nexts += other.nexts;
+  this->internal_keys_skipped += other.internal_keys_skipped;
+  this->bytes_read += other.bytes_read;
+  this->read_nanos += other.read_nanos;
+  for (auto& [level, other_level] : other.levels) {
+    auto& level_stats = this->levels[level];
+    level_stats.bloom_useful += other_level.bloom_useful;
+    level_stats.bloom_positive += other_level.bloom_positive;
+    level_stats.bloom_true_positive += other_level.bloom_true_positive;
+    level_stats.get_from_table_nanos += other_level.get_from_table_nanos;
+  }
+}
+
+void PerfStats::Log(const std::string& name) const {
+  spdlog::info(
+      "({0}_block_reads, {0}_block_read_bytes, {0}_block_read_us, "
+      "{0}_bloom_checks, {0}_bloom_hits, {0}_get_from_table_us) : ({1}, {2}, "
+      "{3:.0f}, {4}, {5}, {6:.0f})",
+      name, this->block_reads, this->block_read_bytes,
+      this->block_read_nanos / 1e3, this->bloom_checks, this->bloom_hits,
+      this->get_from_table_nanos / 1e3);
+  spdlog::info(
+      "({0}_seeks, {0}_nexts, {0}_internal_keys_skipped, {0}_io_bytes_read, "
+      "{0}_io_read_us) : ({1}, {2}, {3}, {4}, {5:.0f})",
+      name, this->seeks, this->nexts, this->internal_keys_skipped,
+      this->bytes_read, this->read_nanos / 1e3);
+  for (auto& [level, level_stats] : this->levels) {
+    spdlog::info(
+        "({0}_l{1}_bloom_useful, {0}_l{1}_bloom_positive, "
+        "{0}_l{1}_bloom_true_positive, {0}_l{1}_get_from_table_us) : ({2}, "
+        "{3}, {4}, {5:.0f})",
+        name, level, level_stats.bloom_useful, level_stats.bloom_positive,
+        level_stats.bloom_true_positive,
+        level_stats.get_from_table_nanos / 1e3);
+  }
+}
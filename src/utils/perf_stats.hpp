@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+#include "rocksdb/perf_level.h"
+
+// Read path counters of one level, from PerfContextByLevel. A positive
+// filter result costs a data block read, so bloom_positive less
+// bloom_true_positive is the number of block reads wasted on the level.
+struct LevelPerfStats {
+  uint64_t bloom_useful = 0;
+  uint64_t bloom_positive = 0;
+  uint64_t bloom_true_positive = 0;
+  uint64_t get_from_table_nanos = 0;
+};
+
+// Where the reads of a set of operations went, taken from the PerfContext and
+// IOStatsContext of the thread that ran them. Both contexts are thread
+// local, so every client thread enables and captures its own and the
+// captures are merged. Times are only counted from
+// rocksdb::kEnableTimeExceptForMutex up.
+struct PerfStats {
+  uint64_t block_reads = 0;
+  uint64_t block_read_bytes = 0;
+  uint64_t block_read_nanos = 0;
+  uint64_t bloom_checks = 0;
+  uint64_t bloom_hits = 0;
+  uint64_t get_from_table_nanos = 0;
+  uint64_t seeks = 0;
+  uint64_t nexts = 0;
+  uint64_t internal_keys_skipped = 0;
+  uint64_t bytes_read = 0;
+  uint64_t read_nanos = 0;
+  std::map<uint32_t, LevelPerfStats> levels;
+
+  // Sets the perf level of the calling thread and resets its contexts, per
+  // level counters are kept from rocksdb::kEnableCount up. Lower levels tear
+  // the per level counters down.
+  static void Enable(rocksdb::PerfLevel level);
+
+  // Zeroes the counters of the calling thread, per level ones included,
+  // without disabling any of them
+  static void Reset();
+
+  // Counters of the calling thread since it was last enabled or reset
+  static PerfStats Capture();
+
+  void Merge(const PerfStats& other);
+
+  void Log(const std::string& name) const;
+};
@@ -0,0 +1,91 @@
+#include "throttled_fs.hpp"
+
+#include <chrono>
+#include <thread>
+
+namespace {
+
+class ThrottledRandomAccessFile
+    : public rocksdb::FSRandomAccessFileOwnerWrapper {
+ public:
+  ThrottledRandomAccessFile(std::unique_ptr<rocksdb::FSRandomAccessFile>&& file,
+                            uint64_t read_latency_us)
+      : rocksdb::FSRandomAccessFileOwnerWrapper(std::move(file)),
+        read_latency_us_(read_latency_us) {}
+
+  rocksdb::IOStatus Read(uint64_t offset, size_t n,
+                         const rocksdb::IOOptions& options,
+                         rocksdb::Slice* result, char* scratch,
+                         rocksdb::IODebugContext* dbg) const override {
+    std::this_thread::sleep_for(std::chrono::microseconds(read_latency_us_));
+    return rocksdb::FSRandomAccessFileOwnerWrapper::Read(
+        offset, n, options, result, scratch, dbg);
+  }
+
+ private:
+  uint64_t read_latency_us_;
+};
+
+class ThrottledWritableFile : public rocksdb::FSWritableFileOwnerWrapper {
+ public:
+  ThrottledWritableFile(std::unique_ptr<rocksdb::FSWritableFile>&& file,
+                        uint64_t write_bytes_per_sec)
+      : rocksdb::FSWritableFileOwnerWrapper(std::move(file)),
+        write_bytes_per_sec_(write_bytes_per_sec) {}
+
+  rocksdb::IOStatus Append(const rocksdb::Slice& data,
+                           const rocksdb::IOOptions& options,
+                           rocksdb::IODebugContext* dbg) override {
+    std::this_thread::sleep_for(std::chrono::microseconds(
+        data.size() * 1'000'000 / write_bytes_per_sec_));
+    return rocksdb::FSWritableFileOwnerWrapper::Append(data, options, dbg);
+  }
+
+ private:
+  uint64_t write_bytes_per_sec_;
+};
+
+}  // namespace
+
+ThrottledFileSystem::ThrottledFileSystem(
+    const std::shared_ptr<rocksdb::FileSystem>& base, std::string slow_prefix,
+    uint64_t read_latency_us, uint64_t write_bytes_per_sec)
+    : rocksdb::FileSystemWrapper(base),
+      slow_prefix_(std::move(slow_prefix)),
+      read_latency_us_(read_latency_us),
+      write_bytes_per_sec_(write_bytes_per_sec) {}
+
+rocksdb::IOStatus ThrottledFileSystem::NewRandomAccessFile(
+    const std::string& fname, const rocksdb::FileOptions& file_opts,
+    std::unique_ptr<rocksdb::FSRandomAccessFile>* result,
+    rocksdb::IODebugContext* dbg) {
+  auto s = rocksdb::FileSystemWrapper::NewRandomAccessFile(fname, file_opts,
+                                                           result, dbg);
+  if (s.ok() && this->read_latency_us_ > 0 && this->IsSlow(fname)) {
+    result->reset(new ThrottledRandomAccessFile(std::move(*result),
+                                                this->read_latency_us_));
+  }
+  return s;
+}
+
+rocksdb::IOStatus ThrottledFileSystem::NewWritableFile(
+    const std::string& fname, const rocksdb::FileOptions& file_opts,
+    std::unique_ptr<rocksdb::FSWritableFile>* result,
+    rocksdb::IODebugContext* dbg) {
+  auto s = rocksdb::FileSystemWrapper::NewWritableFile(fname, file_opts,
+                                                       result, dbg);
+  if (s.ok() && this->write_bytes_per_sec_ > 0 && this->IsSlow(fname)) {
+    result->reset(new ThrottledWritableFile(std::move(*result),
+                                            this->write_bytes_per_sec_));
+  }
+  return s;
+}
+
+std::unique_ptr<rocksdb::Env> new_throttled_env(std::string slow_prefix,
+                                                uint64_t read_latency_us,
+                                                uint64_t write_bytes_per_sec) {
+  auto fs = std::make_shared<ThrottledFileSystem>(
+      rocksdb::FileSystem::Default(), std::move(slow_prefix), read_latency_us,
+      write_bytes_per_sec);
+  return rocksdb::NewCompositeEnv(fs);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "rocksdb/env.h"
+#include "rocksdb/file_system.h"
+
+// File system that simulates a slower device for every file under
+// slow_prefix, used to try out storage tiering with two local directories.
+// Reads of those files pay read_latency_us each and writes are held to
+// write_bytes_per_sec (0 disables either limit).
+class ThrottledFileSystem : public rocksdb::FileSystemWrapper {
+ public:
+  ThrottledFileSystem(const std::shared_ptr<rocksdb::FileSystem>& base,
+                      std::string slow_prefix, uint64_t read_latency_us,
+                      uint64_t write_bytes_per_sec);
+
+  static const char* kClassName() { return "ThrottledFileSystem"; }
+  const char* Name() const override { return kClassName(); }
+
+  rocksdb::IOStatus NewRandomAccessFile(
+      const std::string& fname, const rocksdb::FileOptions& file_opts,
+      std::unique_ptr<rocksdb::FSRandomAccessFile>* result,
+      rocksdb::IODebugContext* dbg) override;
+
+  rocksdb::IOStatus NewWritableFile(
+      const std::string& fname, const rocksdb::FileOptions& file_opts,
+      std::unique_ptr<rocksdb::FSWritableFile>* result,
+      rocksdb::IODebugContext* dbg) override;
+
+ private:
+  bool IsSlow(const std::string& fname) {
+    return fname.compare(0, slow_prefix_.size(), slow_prefix_) == 0;
+  }
+
+  std::string slow_prefix_;
+  uint64_t read_latency_us_;
+  uint64_t write_bytes_per_sec_;
+};
+
+// Env running on a ThrottledFileSystem over the default file system
+std::unique_ptr<rocksdb::Env> new_throttled_env(std::string slow_prefix,
+                                                uint64_t read_latency_us,
+                                                uint64_t write_bytes_per_sec);
@@ -1,6 +1,8 @@
 #include "utils.hpp"
 
 #include <rocksdb/db.h>
+#include <rocksdb/filter_policy.h>
+#include <rocksdb/table.h>
 #include <spdlog/spdlog.h>
 
 bool compactions_in_progress(rocksdb::DB *db) {
@@ -42,3 +44,42 @@ void log_state_of_tree(rocksdb::DB *db) {
                  level_str);
   }
 }
+
+void apply_kap_options(rocksdb::Options &opt,
+                       const kaplsm::KapOptions &kap_opt) {
+  // Classic LSM parameters
+  opt.target_file_size_multiplier = kap_opt.size_ratio;
+  opt.target_file_size_base = kap_opt.buffer_size;
+  opt.write_buffer_size = kap_opt.buffer_size;
+
+  // Slow down triggers, follow the kapacity of L0
+  int l0_kapacity = kap_opt.Kapacity(0, 0);
+  opt.level0_slowdown_writes_trigger = 2 * (l0_kapacity + 1);
+  opt.level0_stop_writes_trigger = 3 * (l0_kapacity + 1);
+  opt.level0_file_num_compaction_trigger = l0_kapacity;
+
+  // Monkey filter policy
+  rocksdb::BlockBasedTableOptions table_options;
+  table_options.filter_policy.reset(rocksdb::NewMonkeyFilterPolicy(
+      kap_opt.bits_per_element, kap_opt.size_ratio, 20));
+  table_options.no_block_cache = true;
+  opt.table_factory.reset(rocksdb::NewBlockBasedTableFactory(table_options));
+
+  // Each storage path takes the levels the compactor assigns to it, sizes
+  // are not used for placement
+  opt.cf_paths.clear();
+  for (auto &storage_path : kap_opt.storage_paths) {
+    opt.cf_paths.emplace_back(storage_path.path, UINT64_MAX);
+  }
+
+  // Key-value separation, blob files are cut at the buffer size like SSTs
+  opt.enable_blob_files = kap_opt.blob_separation;
+  if (kap_opt.blob_separation) {
+    opt.min_blob_size = kap_opt.min_blob_size;
+    opt.blob_file_size = kap_opt.buffer_size;
+    opt.enable_blob_garbage_collection = true;
+    opt.blob_garbage_collection_age_cutoff = kap_opt.blob_gc_age_cutoff;
+    opt.blob_garbage_collection_force_threshold =
+        kap_opt.blob_gc_force_threshold;
+  }
+}
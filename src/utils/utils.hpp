@@ -1,7 +1,14 @@
 #pragma once
 
+#include "kap_options.hpp"
 #include "rocksdb/db.h"
+#include "rocksdb/options.h"
 
 void wait_for_all_compactions_and_close_db(rocksdb::DB *db);
 
 void log_state_of_tree(rocksdb::DB *db);
+
+// Column family options that follow the tuning of its KapOptions, shared by
+// build_db, run_db and every column family they open
+void apply_kap_options(rocksdb::Options &opt,
+                       const kaplsm::KapOptions &kap_opt);
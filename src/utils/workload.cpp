@@ -0,0 +1,159 @@
+#include "workload.hpp"
+
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <fstream>
+#include <numeric>
+
+namespace {
+constexpr std::array<const char*, static_cast<size_t>(OpType::kNumOpTypes)>
+    kOpTypeNames = {"read", "empty_read", "update",
+                    "insert", "scan", "read_modify_write"};
+}  // namespace
+
+const char* OpTypeName(OpType op) {
+  return kOpTypeNames[static_cast<size_t>(op)];
+}
+
+bool WorkloadSpec::Load(const std::string& spec,
+                        const std::string& distribution) {
+  this->default_distribution_ = distribution;
+  WorkloadPhase phase;
+  if (WorkloadSpec::Preset(spec, &phase)) {
+    if (!distribution.empty()) {
+      phase.distribution = distribution;
+    }
+    this->phases = {phase};
+    return true;
+  }
+
+  return this->ReadSpec(spec);
+}
+
+bool WorkloadSpec::ReadSpec(const std::string& spec_path) {
+  nlohmann::json cfg;
+  std::ifstream read_cfg(spec_path);
+  if (!read_cfg.is_open()) {
+    spdlog::error("Unable to read workload spec: {}", spec_path);
+    return false;
+  }
+  read_cfg >> cfg;
+
+  this->phases.clear();
+  for (auto& entry : cfg.value("phases", nlohmann::json::array())) {
+    WorkloadPhase phase;
+    if (!this->ParsePhase(entry, &phase)) {
+      return false;
+    }
+    if (phase.name.empty()) {
+      phase.name = "phase" + std::to_string(this->phases.size());
+    }
+    this->phases.push_back(phase);
+  }
+  if (this->phases.empty()) {
+    spdlog::error("Workload spec {} has no phases", spec_path);
+    return false;
+  }
+
+  return true;
+}
+
+bool WorkloadSpec::ParsePhase(const nlohmann::json& cfg,
+                              WorkloadPhase* phase) {
+  std::string preset = cfg.value("preset", "");
+  if (!preset.empty() && !WorkloadSpec::Preset(preset, phase)) {
+    spdlog::error("Unknown workload preset: {}", preset);
+    return false;
+  }
+  if (!this->default_distribution_.empty()) {
+    phase->distribution = this->default_distribution_;
+  }
+  phase->name = cfg.value("name", phase->name);
+  // A duration given without num_ops replaces the preset's operation count
+  if (cfg.contains("duration_sec") && !cfg.contains("num_ops")) {
+    phase->num_ops = 0;
+  }
+  phase->num_ops = cfg.value("num_ops", phase->num_ops);
+  phase->duration_sec = cfg.value("duration_sec", phase->duration_sec);
+  phase->distribution = cfg.value("distribution", phase->distribution);
+  phase->ops_per_sec = cfg.value("ops_per_sec", phase->ops_per_sec);
+  phase->arrival = cfg.value("arrival", phase->arrival);
+  phase->scan_length = cfg.value("scan_length", phase->scan_length);
+  if (cfg.contains("mix")) {
+    phase->mix.fill(0);
+    for (auto& [op_name, weight] : cfg["mix"].items()) {
+      auto it = std::find(kOpTypeNames.begin(), kOpTypeNames.end(), op_name);
+      if (it == kOpTypeNames.end()) {
+        spdlog::error("Unknown operation in workload mix: {}", op_name);
+        return false;
+      }
+      phase->mix[it - kOpTypeNames.begin()] = weight.get<double>();
+    }
+  }
+
+  double total = std::accumulate(phase->mix.begin(), phase->mix.end(), 0.0);
+  if (total <= 0) {
+    spdlog::error("Workload phase {} has an empty mix", phase->name);
+    return false;
+  }
+  for (auto& fraction : phase->mix) {
+    fraction /= total;
+  }
+  if (phase->num_ops == 0 && phase->duration_sec <= 0) {
+    spdlog::error("Workload phase {} needs num_ops or duration_sec",
+                  phase->name);
+    return false;
+  }
+  if (phase->distribution != "uniform" && phase->distribution != "zipf" &&
+      phase->distribution != "hotspot" && phase->distribution != "latest") {
+    spdlog::error("Unknown key distribution: {}", phase->distribution);
+    return false;
+  }
+  if (phase->arrival != "constant" && phase->arrival != "poisson") {
+    spdlog::error("Unknown arrival process: {}", phase->arrival);
+    return false;
+  }
+
+  return true;
+}
+
+bool WorkloadSpec::Preset(const std::string& name, WorkloadPhase* phase) {
+  WorkloadPhase preset;
+  preset.name = name;
+  preset.num_ops = 100'000;
+  preset.distribution = "zipf";
+  auto set = [&](OpType op, double fraction) {
+    preset.mix[static_cast<size_t>(op)] = fraction;
+  };
+  if (name == "ycsb_a") {
+    // Update heavy
+    set(OpType::kRead, 0.5);
+    set(OpType::kUpdate, 0.5);
+  } else if (name == "ycsb_b") {
+    // Read mostly
+    set(OpType::kRead, 0.95);
+    set(OpType::kUpdate, 0.05);
+  } else if (name == "ycsb_c") {
+    // Read only
+    set(OpType::kRead, 1.0);
+  } else if (name == "ycsb_d") {
+    // Read latest
+    set(OpType::kRead, 0.95);
+    set(OpType::kInsert, 0.05);
+    preset.distribution = "latest";
+  } else if (name == "ycsb_e") {
+    // Short ranges
+    set(OpType::kScan, 0.95);
+    set(OpType::kInsert, 0.05);
+  } else if (name == "ycsb_f") {
+    // Read-modify-write
+    set(OpType::kRead, 0.5);
+    set(OpType::kReadModifyWrite, 0.5);
+  } else {
+    return false;
+  }
+  *phase = preset;
+
+  return true;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <vector>
+
+// Operations a workload phase mixes together
+enum class OpType {
+  kRead = 0,   // Get of a key present in the DB
+  kEmptyRead,  // Get of a key that was never written
+  kUpdate,     // Put over a key present in the DB
+  kInsert,     // Put of a new key
+  kScan,       // Seek followed by scan_length Next calls
+  kReadModifyWrite,
+  kNumOpTypes
+};
+
+const char* OpTypeName(OpType op);
+
+// A phase issues num_ops operations, or runs for duration_sec when num_ops
+// is 0, drawing every operation from the mix and its key from distribution
+// ("uniform", "zipf", "hotspot" or "latest", skewed by run_db's options).
+// ops_per_sec is the open-loop rate of the whole phase across client
+// threads, with constant or Poisson arrivals, 0 issues operations back to
+// back (closed-loop).
+struct WorkloadPhase {
+  std::string name;
+  std::array<double, static_cast<size_t>(OpType::kNumOpTypes)> mix{};
+  uint64_t num_ops = 0;
+  double duration_sec = 0;
+  std::string distribution = "uniform";
+  double ops_per_sec = 0;
+  std::string arrival = "constant";
+  int scan_length = 100;
+
+  double Fraction(OpType op) const {
+    return this->mix[static_cast<size_t>(op)];
+  }
+};
+
+// Ordered phases run one after the other against the same DB. A spec is
+// either a JSON file
+//
+//   {"phases": [{"name": "warmup", "preset": "ycsb_c", "num_ops": 100000},
+//               {"name": "mixed", "mix": {"read": 50, "update": 45,
+//                "scan": 5}, "duration_sec": 60, "distribution": "zipf"}]}
+//
+// where a phase may start from a preset and override any field (mix weights
+// are normalized), or the name of a preset run as a single phase.
+class WorkloadSpec {
+ public:
+  std::vector<WorkloadPhase> phases;
+
+  // Accepts a preset name (ycsb_a to ycsb_f) or the path of a JSON spec.
+  // A non-empty distribution replaces the distribution of every phase that
+  // does not name one, presets included.
+  bool Load(const std::string& spec, const std::string& distribution = "");
+  bool ReadSpec(const std::string& spec_path);
+
+  // YCSB core workloads A to F, 100k operations each
+  static bool Preset(const std::string& name, WorkloadPhase* phase);
+
+ private:
+  bool ParsePhase(const nlohmann::json& cfg, WorkloadPhase* phase);
+
+  std::string default_distribution_;
+};